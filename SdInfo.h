@@ -40,10 +40,14 @@
 #define CMD9     0X09
  /** SEND_CID - read the card identification information (CID register) */
 #define CMD10    0X0A
+/** STOP_TRANSMISSION - end multiple block read sequence */
+#define CMD12    0X0C
 /** SEND_STATUS - read the card status register */
 #define CMD13    0X0D
 /** READ_BLOCK - read a single data block from the card */
 #define CMD17    0X11
+/** READ_MULTIPLE_BLOCK - read blocks of data until a STOP_TRANSMISSION */
+#define CMD18    0X12
 /** WRITE_BLOCK - write a single data block to the card */
 #define CMD24    0X18
 /** WRITE_MULTIPLE_BLOCK - write blocks of data until a STOP_TRANSMISSION */
@@ -3,22 +3,51 @@
 #include "globals.h"
 #include "SdReader.h"
 #include "WavePinDefs.h"
+#include "bench.h"
+#include "trace.h"
+#ifndef SD_EMULATOR
+#include "os.h"
+#endif  // SD_EMULATOR
 
 uint32_t block_;
 uint8_t errorCode_=0;
 uint8_t errorData_=0;
 uint8_t inBlock_=0;
+uint8_t inStream_=0;
+uint8_t inWrite_=0;
+uint32_t writeTime_;
+uint8_t inWriteStream_=0;
+uint16_t writeOffset_;
+uint32_t streamBlock_;
 uint16_t offset_;
 uint8_t partialBlockRead_=0;
 uint8_t response_;
 uint8_t type_=0;
 
+//------------------------------------------------------------------------------
+// SPI data register access
+#ifdef SD_EMULATOR
+// host build, the card on the other end of the bus is emulated by SdEmu.c
+#include "SdEmu.h"
+uint8_t spiData_;
+/** Start transfer of a byte */
+#define spiStart(b) (spiData_ = sdEmuTransfer((b), !(PORTB & _BV(SS))))
+/** Wait for the transfer to finish */
+#define spiWait()
+/** Byte received by the last transfer */
+#define spiData() spiData_
+#else  // SD_EMULATOR
+#define spiStart(b) (SPDR = (b))
+#define spiWait() while(!(SPSR & (1 << SPIF)))
+#define spiData() SPDR
+#endif  // SD_EMULATOR
+
 //------------------------------------------------------------------------------
 // inline SPI functions
 /** Send a byte to the card */
-inline void spiSend(uint8_t b) {SPDR = b; while(!(SPSR & (1 << SPIF)));}
+inline void spiSend(uint8_t b) {spiStart(b); spiWait();}
 /** Receive a byte from the card */
-inline uint8_t spiRec(void) {spiSend(0XFF); return SPDR;}
+inline uint8_t spiRec(void) {spiSend(0XFF); return spiData();}
 /** Set Slave Select high */
 inline void spiSSHigh(void) {
    //digitalWrite(SS, HIGH);
@@ -33,6 +62,21 @@ inline void spiSSLow(void) {
    cbi(PORTB, SS);
 }
 
+//------------------------------------------------------------------------------
+/**
+ * Check a wait that started at tick \a t0 against its timeout.  Polls
+ * within the first tick spin, after that the calling thread sleeps for a
+ * tick between polls so a slow card does not hold up the other threads.
+ * Before the OS is started every poll spins.
+ */
+static uint8_t sdTimedOut(uint32_t t0, uint16_t timeoutMillis) {
+   uint32_t t = os_ticks() - t0;
+
+   if (t > timeoutMillis) return 1;
+   if (t && os_running()) thread_sleep(1);
+   return 0;
+}
+
 //------------------------------------------------------------------------------
 // card status
 /** status for card in the ready state */
@@ -51,6 +95,7 @@ inline void spiSSLow(void) {
 #define DATA_RES_WRITE_ERROR  0X0D
 
 void error1(uint8_t code) {errorCode_ = code;}
+uint8_t sdErrorCode(void) {return errorCode_;}
 void error2(uint8_t code, uint8_t data) {errorCode_ = code; errorData_ = data;}
 
 /**
@@ -92,17 +137,28 @@ uint8_t sdCardCommand(uint8_t cmd, uint32_t arg) {
    uint8_t r1;
    uint8_t retry;
    signed char s;
+   uint16_t busyMillis;
 
    // end read if in partialBlockRead mode
    sdReadEnd();
 
+   // end multiple block read unless this is the command that stops it
+   if (cmd != CMD12) sdStreamStop();
+
+   // end multiple block write, a single block write still programming is
+   // waited for below as long as a write may take
+   if (inWriteStream_) sdWriteStop();
+   busyMillis = inWrite_ ? SD_WRITE_TIMEOUT : 300;
+   inWrite_ = 0;
+
    // select card
    spiSSLow();
 
-   // wait up to 300 ms if busy
-   sdWaitNotBusy(300);
+   // wait if busy, card is still sending data before CMD12
+   if (cmd != CMD12) sdWaitNotBusy(busyMillis);
 
    // send command
+   TRACE(TRACE_SD_CMD, cmd);
    spiSend(cmd | 0x40);
 
    // send argument
@@ -114,8 +170,12 @@ uint8_t sdCardCommand(uint8_t cmd, uint32_t arg) {
    if (cmd == CMD8) crc = 0X87; // correct crc for CMD8 with arg 0X1AA
    spiSend(crc);
 
+   // skip stuff byte for stop read
+   if (cmd == CMD12) spiRec();
+
    // wait for response
    for (retry = 0; ((r1 = spiRec()) & 0X80) && retry != 0XFF; retry++);
+   TRACE(TRACE_SD_R1, r1);
 
    return r1;
 }
@@ -164,7 +224,7 @@ uint8_t sdInit(uint8_t slow) {
    uint8_t r;
    uint16_t i;
    uint8_t retry;
-   uint32_t t0=0;
+   uint32_t t0;
 
    //pinMode(SS, OUTPUT);
    DDRB |= _BV(SS);
@@ -224,16 +284,13 @@ uint8_t sdInit(uint8_t slow) {
    }
 
    // initialize card and send host supports SDHC if SD2
-   t0=0;
+   t0 = os_ticks();
    for (;;) {
-      _delay_us(2);
-      t0++;
       sdCardCommand(CMD55, 0);
       r = sdCardCommand(ACMD41, sdType() == SD_CARD_TYPE_SD2 ? 0X40000000 : 0);
       if (r == R1_READY_STATE) break;
 
-      // timeout after 2 seconds
-      if ((t0/1000) > 2000) {
+      if (sdTimedOut(t0, SD_INIT_TIMEOUT)) {
          error1(SD_CARD_ERROR_ACMD41);
          return 0;
       }
@@ -278,6 +335,7 @@ uint8_t sdReadData(uint32_t block,
    if ((count + offset) > 512) {
       return 0;
    }
+   bench_begin(BENCH_READ);
    if (!inBlock_ || block != block_ || offset < offset_) {
       block_ = block;
 
@@ -285,9 +343,11 @@ uint8_t sdReadData(uint32_t block,
       if (sdType()!= SD_CARD_TYPE_SDHC) block <<= 9;
       if (sdCardCommand(CMD17, block)) {
          error1(SD_CARD_ERROR_CMD17);
+         bench_end(BENCH_READ);
          return 0;
       }
       if (!sdWaitStartBlock()) {
+         bench_end(BENCH_READ);
          return 0;
       }
       offset_ = 0;
@@ -295,27 +355,28 @@ uint8_t sdReadData(uint32_t block,
    }
 
    // start first SPI transfer
-   SPDR = 0XFF;
+   spiStart(0XFF);
 
    // skip data before offset
    for (;offset_ < offset; offset_++) {
-      while(!(SPSR & (1 << SPIF)));
-      SPDR = 0XFF;
+      spiWait();
+      spiStart(0XFF);
    }
 
    // transfer data
    uint16_t n = count - 1;
    for (i = 0; i < n; i++) {
-      while(!(SPSR & (1 << SPIF)));
-      dst[i] = SPDR;
-      SPDR = 0XFF;
+      spiWait();
+      dst[i] = spiData();
+      spiStart(0XFF);
    }
 
    // wait for last byte
-   while(!(SPSR & (1 << SPIF)));
-   dst[n] = SPDR;
+   spiWait();
+   dst[n] = spiData();
    offset_ += count;
    if (!partialBlockRead_ || offset_ >= 512) sdReadEnd();
+   bench_end(BENCH_READ);
    return 1;
 }
 
@@ -324,18 +385,409 @@ uint8_t sdReadData(uint32_t block,
 void sdReadEnd(void) {
    if (inBlock_) {
       // skip data and crc
-      SPDR = 0XFF;
+      spiStart(0XFF);
       while (offset_++ < 513) {
-         while(!(SPSR & (1 << SPIF)));
-         SPDR = 0XFF;
+         spiWait();
+         spiStart(0XFF);
       }
       // wait for last crc byte
-      while(!(SPSR & (1 << SPIF)));
+      spiWait();
       spiSSHigh();
       inBlock_ = 0;
    }
 }
 
+//------------------------------------------------------------------------------
+/**
+ * Start a multiple block read from a SD card.
+ *
+ * The card keeps sending consecutive blocks until sdStreamStop() is called
+ * or another command is sent, so sequential data only pays for the command
+ * and start token once instead of once per block.
+ *
+ * \param[in] block Logical block to start reading at.
+ * \param[in] offset Number of bytes to skip at start of block
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdStreamStart(uint32_t block, uint16_t offset) {
+   uint32_t arg = block;
+
+   if (offset >= 512) return 0;
+
+   // use address if not SDHC card
+   if (sdType() != SD_CARD_TYPE_SDHC) arg <<= 9;
+   if (sdCardCommand(CMD18, arg)) {
+      error1(SD_CARD_ERROR_CMD18);
+      return 0;
+   }
+   inStream_ = 1;
+   streamBlock_ = block;
+   if (!sdWaitStartBlock()) {
+      // no data to skip, just stop the transfer
+      offset_ = 514;
+      sdStreamStop();
+      return 0;
+   }
+   offset_ = 0;
+
+   // skip data before offset
+   return sdStreamRead(0, offset);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Read data from an open multiple block read.
+ *
+ * Reads may cross block boundaries, the CRC of the finished block and the
+ * start token of the next one are consumed on the way.
+ *
+ * \param[out] dst Pointer to the location that will receive the data,
+ * data is skipped if \a dst is null.
+ * \param[in] count Number of bytes to read
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdStreamRead(uint8_t *dst, uint16_t count) {
+   uint16_t i, n;
+
+   if (!inStream_) return 0;
+
+   while (count) {
+      // move on to the next block, offset_ is 514 once the crc is skipped
+      if (offset_ >= 512) {
+         while (offset_++ < 514) spiRec();
+         if (!sdWaitStartBlock()) {
+            sdStreamStop();
+            return 0;
+         }
+         streamBlock_++;
+         offset_ = 0;
+      }
+
+      n = 512 - offset_;
+      if (n > count) n = count;
+      offset_ += n;
+      count -= n;
+
+      // start first SPI transfer
+      spiStart(0XFF);
+
+      // transfer data
+      for (i = 1; i < n; i++) {
+         spiWait();
+         if (dst) *dst++ = spiData();
+         spiStart(0XFF);
+      }
+
+      // wait for last byte
+      spiWait();
+      if (dst) *dst++ = spiData();
+   }
+   return 1;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Move an open multiple block read forward to the given location by
+ * skipping bytes, as long as it is in the current or the next block.
+ * Skipping is cheaper than stopping the read and sending a new command.
+ *
+ * \param[in] block Logical block of the location.
+ * \param[in] offset Byte offset of the location in the block.
+ *
+ * \return The value one, true, is returned if the stream is now at the
+ * location.  The value zero, false, is returned if it could not be reached.
+ */
+uint8_t sdStreamSeek(uint32_t block, uint16_t offset) {
+   uint16_t pos;
+
+   if (!inStream_) return 0;
+   pos = offset_ < 512 ? offset_ : 512;
+
+   if (block == streamBlock_) {
+      if (offset < pos) return 0;
+   } else if (block == streamBlock_ + 1) {
+      offset += 512;
+   } else {
+      return 0;
+   }
+   if (offset > pos) return sdStreamRead(0, offset - pos);
+   return 1;
+}
+
+//------------------------------------------------------------------------------
+/** End a multiple block read with CMD12. */
+void sdStreamStop(void) {
+   if (!inStream_) return;
+   inStream_ = 0;
+
+   // skip rest of the block and crc so the card is between blocks
+   if (offset_ < 514) {
+      spiStart(0XFF);
+      while (offset_++ < 513) {
+         spiWait();
+         spiStart(0XFF);
+      }
+      spiWait();
+   }
+
+   if (sdCardCommand(CMD12, 0)) error1(SD_CARD_ERROR_CMD12);
+   sdWaitNotBusy(SD_READ_TIMEOUT);
+   spiSSHigh();
+}
+
+//------------------------------------------------------------------------------
+// end a data packet for a write and check the data response token
+static uint8_t sdEndData(void) {
+   // dummy crc
+   spiSend(0XFF);
+   spiSend(0XFF);
+
+   response_ = spiRec();
+   if ((response_ & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
+      error2(SD_CARD_ERROR_WRITE, response_);
+      return 0;
+   }
+   return 1;
+}
+
+//------------------------------------------------------------------------------
+// send a data packet for a write, count bytes from src padded with zeros
+// to a full block, and check the data response token
+static uint8_t sdSendData(uint8_t token, const uint8_t *src, uint16_t count) {
+   uint16_t i;
+
+   spiSend(token);
+   for (i = 0; i < 512; i++) spiSend(i < count ? src[i] : 0);
+   return sdEndData();
+}
+
+//------------------------------------------------------------------------------
+// check the card status after a block was programmed
+static uint8_t sdWriteStatus(void) {
+   // response is r2 so get and check two bytes for nonzero
+   if (sdCardCommand(CMD13, 0) || spiRec()) {
+      error1(SD_CARD_ERROR_WRITE_PROGRAMMING);
+      spiSSHigh();
+      return 0;
+   }
+   spiSSHigh();
+   return 1;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Write a 512 byte block to a SD card.
+ *
+ * \param[in] block Logical block to be written.
+ * \param[in] src Pointer to the location of the data to be written.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdWriteBlock(uint32_t block, const uint8_t *src) {
+   return sdWriteData(block, src, 512);
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Write the start of a 512 byte block, the rest of the block is filled
+ * with zeros so small records do not need a block sized buffer.
+ *
+ * Returns once the card has finished programming the block and reports
+ * no error in its status.
+ *
+ * \param[in] block Logical block to be written.
+ * \param[in] src Pointer to the location of the data to be written.
+ * \param[in] count Number of bytes to write, at most 512.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdWriteData(uint32_t block, const uint8_t *src, uint16_t count) {
+   if (!sdWriteSend(block, src, count)) return 0;
+   inWrite_ = 0;
+
+   // wait for flash programming to complete
+   spiSSLow();
+   if (!sdWaitNotBusy(SD_WRITE_TIMEOUT)) {
+      error1(SD_CARD_ERROR_WRITE_TIMEOUT);
+      spiSSHigh();
+      return 0;
+   }
+   return sdWriteStatus();
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Send a block to write like sdWriteData() but return while the card is
+ * still programming it, with the card deselected.  Poll sdWriteDone()
+ * until it returns true, other commands may be sent meanwhile and wait
+ * for the card themselves.
+ *
+ * \param[in] block Logical block to be written.
+ * \param[in] src Pointer to the location of the data to be written.
+ * \param[in] count Number of bytes to write, at most 512.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdWriteSend(uint32_t block, const uint8_t *src, uint16_t count) {
+   // use address if not SDHC card
+   if (sdType() != SD_CARD_TYPE_SDHC) block <<= 9;
+   if (sdCardCommand(CMD24, block)) {
+      error1(SD_CARD_ERROR_CMD24);
+      goto fail;
+   }
+   if (!sdSendData(DATA_START_BLOCK, src, count)) goto fail;
+
+   writeTime_ = os_ticks();
+   inWrite_ = 1;
+   spiSSHigh();
+   return 1;
+
+ fail:
+   spiSSHigh();
+   return 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Check on a write started with sdWriteSend(), checks the card status
+ * once it is done.  When another command was sent first the status is
+ * not checked, that command already waited for the card.
+ *
+ * \return The value one, true, is returned once the write is over and
+ * the value zero, false, while the card is still programming.  A failed
+ * write sets the error code.
+ */
+uint8_t sdWriteDone(void) {
+   if (!inWrite_) return 1;
+
+   spiSSLow();
+   if (spiRec() != 0XFF) {
+      if (os_ticks() - writeTime_ <= SD_WRITE_TIMEOUT) {
+         spiSSHigh();
+         return 0;
+      }
+      error1(SD_CARD_ERROR_WRITE_TIMEOUT);
+      inWrite_ = 0;
+      spiSSHigh();
+      return 1;
+   }
+   inWrite_ = 0;
+   sdWriteStatus();
+   return 1;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Start a multiple block write.
+ *
+ * The card is told how many blocks follow so it can erase them at once,
+ * which costs far less flash wear and time than a write per block.  Send
+ * the data with sdWriteNext() and finish with sdWriteStop(), any other
+ * command ends the write early.
+ *
+ * \param[in] block Logical block of the first block to write.
+ * \param[in] count Number of blocks that will be written.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdWriteStart(uint32_t block, uint32_t count) {
+   // pre-erase hint
+   sdCardCommand(CMD55, 0);
+   if (sdCardCommand(ACMD23, count)) {
+      error1(SD_CARD_ERROR_ACMD23);
+      goto fail;
+   }
+   // use address if not SDHC card
+   if (sdType() != SD_CARD_TYPE_SDHC) block <<= 9;
+   if (sdCardCommand(CMD25, block)) {
+      error1(SD_CARD_ERROR_CMD25);
+      goto fail;
+   }
+   inWriteStream_ = 1;
+   writeOffset_ = 0;
+   return 1;
+
+ fail:
+   spiSSHigh();
+   return 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * Write the next bytes of a multiple block write.  Like sdStreamRead()
+ * the data runs on across block boundaries, a block is sent to the card
+ * as its last byte is written.
+ *
+ * \param[in] src Pointer to the location of the data to be written.
+ * \param[in] count Number of bytes to write.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdWriteNext(const uint8_t *src, uint16_t count) {
+   if (!inWriteStream_) return 0;
+
+   while (count--) {
+      if (writeOffset_ == 0) {
+         // wait for the previous block to be programmed
+         if (!sdWaitNotBusy(SD_WRITE_TIMEOUT)) {
+            error1(SD_CARD_ERROR_WRITE_TIMEOUT);
+            goto fail;
+         }
+         spiSend(WRITE_MULTIPLE_TOKEN);
+      }
+      spiSend(*src++);
+      if (++writeOffset_ == 512) {
+         writeOffset_ = 0;
+         if (!sdEndData()) goto fail;
+      }
+   }
+   return 1;
+
+ fail:
+   inWriteStream_ = 0;
+   spiSSHigh();
+   return 0;
+}
+
+//------------------------------------------------------------------------------
+/**
+ * End a multiple block write, the last block is filled with zeros, and
+ * wait for it to be programmed.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdWriteStop(void) {
+   if (!inWriteStream_) return 1;
+
+   if (writeOffset_) {
+      while (writeOffset_++ < 512) spiSend(0);
+      writeOffset_ = 0;
+      if (!sdEndData()) {
+         inWriteStream_ = 0;
+         spiSSHigh();
+         return 0;
+      }
+   }
+   inWriteStream_ = 0;
+
+   if (!sdWaitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
+   spiSend(STOP_TRAN_TOKEN);
+
+   // skip the byte before busy starts
+   spiRec();
+   if (!sdWaitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
+   spiSSHigh();
+   return 1;
+
+ fail:
+   error1(SD_CARD_ERROR_WRITE_TIMEOUT);
+   spiSSHigh();
+   return 0;
+}
+
 //------------------------------------------------------------------------------
 /** read CID or CSR register */
 uint8_t sdReadRegister(uint8_t cmd, uint8_t *dst) {
@@ -359,11 +811,9 @@ uint8_t sdReadRegister(uint8_t cmd, uint8_t *dst) {
 //------------------------------------------------------------------------------
 // wait for card to go not busy
 uint8_t sdWaitNotBusy(uint16_t timeoutMillis) {
-   uint32_t t0 = 0;
+   uint32_t t0 = os_ticks();
    while (spiRec() != 0XFF) {
-      t0++;
-      _delay_us(2);
-      if ((t0/1000) > timeoutMillis) return 0;
+      if (sdTimedOut(t0, timeoutMillis)) return 0;
    }
    return 1;
 }
@@ -372,15 +822,14 @@ uint8_t sdWaitNotBusy(uint16_t timeoutMillis) {
 /** Wait for start block token */
 uint8_t sdWaitStartBlock(void) {
    uint8_t r;
-   uint32_t t0 = 0;
+   uint32_t t0 = os_ticks();
    while ((r = spiRec()) == 0XFF) {
-      t0++;
-      _delay_us(2);
-      if ((t0/1000) > SD_READ_TIMEOUT) {
+      if (sdTimedOut(t0, SD_READ_TIMEOUT)) {
          error1(SD_CARD_ERROR_READ_TIMEOUT);
          return 0;
       }
    }
+   TRACE(TRACE_SD_DATA, r);
    if (r == DATA_START_BLOCK) return 1;
    error2(SD_CARD_ERROR_READ, r);
    return 0;
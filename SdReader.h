@@ -37,6 +37,10 @@
 
 /** read timeout ms */
 #define SD_READ_TIMEOUT    300
+/** write time out ms */
+#define SD_WRITE_TIMEOUT   600
+/** time out ms for the card to leave the idle state at init */
+#define SD_INIT_TIMEOUT    2000
 
 // SD card errors
 /** timeout error for command CMD0 */
@@ -61,6 +65,20 @@
 #define SD_CARD_ERROR_READ_TIMEOUT 0XD
 /** card returned an error token instead of read data */
 #define SD_CARD_ERROR_READ 0X10
+/** card returned an error response for CMD18 (read multiple block) */
+#define SD_CARD_ERROR_CMD18 0X11
+/** card returned an error response for CMD12 (stop transmission) */
+#define SD_CARD_ERROR_CMD12 0X12
+/** card returned an error response for CMD25 (write multiple blocks) */
+#define SD_CARD_ERROR_CMD25 0X13
+/** card returned an error response for ACMD23 (set erase block count) */
+#define SD_CARD_ERROR_ACMD23 0X14
+/** card did not accept the data of a write */
+#define SD_CARD_ERROR_WRITE 0X15
+/** timeout while the card was programming written data */
+#define SD_CARD_ERROR_WRITE_TIMEOUT 0X16
+/** card reported an error after programming a block, CMD13 status */
+#define SD_CARD_ERROR_WRITE_PROGRAMMING 0X17
 //
 // card types
 /** Standard capacity V1 SD card */
@@ -82,9 +100,21 @@ uint8_t sdReadCSD(union csd_t* csd);
 void sdReadEnd(void);
 uint8_t sdWaitStartBlock(void);
 void error(uint8_t code, uint8_t data);
+uint8_t sdErrorCode(void);
 uint8_t sdType(void);
 void sdSetType(uint8_t t);
 uint8_t sdCardCommand(uint8_t cmd, uint32_t arg);
 uint32_t sdCardSize(void);
 uint8_t sdReadRegister(uint8_t cmd, uint8_t *dst);
+uint8_t sdStreamStart(uint32_t block, uint16_t offset);
+uint8_t sdStreamRead(uint8_t *dst, uint16_t count);
+uint8_t sdStreamSeek(uint32_t block, uint16_t offset);
+void sdStreamStop(void);
+uint8_t sdWriteBlock(uint32_t block, const uint8_t *src);
+uint8_t sdWriteData(uint32_t block, const uint8_t *src, uint16_t count);
+uint8_t sdWriteSend(uint32_t block, const uint8_t *src, uint16_t count);
+uint8_t sdWriteDone(void);
+uint8_t sdWriteStart(uint32_t block, uint32_t count);
+uint8_t sdWriteNext(const uint8_t *src, uint16_t count);
+uint8_t sdWriteStop(void);
 #endif //SdReader_h
@@ -0,0 +1,34 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <avr/io.h>
+
+//Timing probes for the simulator benchmark, see make bench.
+//
+//Each probe drives a port C pin high while the code it covers runs, and
+//host/bench.c times the pins in CPU cycles.  A probe is a single SBI or
+//CBI, which touches no registers or flags, so it is safe in naked
+//functions.  Without BENCH the probes compile to nothing.
+#define BENCH_SAMPLE 0     //Sample interrupt
+#define BENCH_TICK 1       //Tick interrupt, up to the context switch
+#define BENCH_SWITCH 2     //context_switch
+#define BENCH_READ 3       //sdReadData
+#define BENCH_CHUNK 4      //getFileChunk
+#define BENCH_UNDERRUN 5   //Pulsed when the sample interrupt runs dry
+
+#ifdef BENCH
+#define bench_init() (DDRC |= 0x3F)
+#define bench_begin(pin) \
+ asm volatile ("SBI %0, %1" : : "I" (_SFR_IO_ADDR(PORTC)), "I" (pin))
+#define bench_end(pin) \
+ asm volatile ("CBI %0, %1" : : "I" (_SFR_IO_ADDR(PORTC)), "I" (pin))
+#else
+#define bench_init()
+#define bench_begin(pin)
+#define bench_end(pin)
+#endif
+
+//A pulse marks an event, the harness counts them
+#define bench_mark(pin) do { bench_begin(pin); bench_end(pin); } while (0)
+
+#endif
@@ -1,58 +1,154 @@
+#include <stddef.h>
+#include <string.h>
 #include "ext2.h"
 #include "globals.h"
 #include "SdReader.h"
-
-#define IN_LEN 256
-#define DIN_LEN 65536
-#define TIN_LEN 16777216
-
-static struct ext2_inode currentInode;
-static uint32_t currentInodeNum = 0;
+#include "bench.h"
+
+
+//Block pointers read at once from an indirect block, power of two
+#define PTR_CACHE_LEN 32
+
+//Runs of contiguous blocks mapped when a file is opened
+#define MAX_EXTENTS 8
+
+//Inodes kept in memory, enough for the root directory and two tracks
+#define INODE_CACHE_LEN 3
+
+//Groups whose inode table location is kept from mount time, the
+//descriptors of later groups are read when needed
+#define GROUP_CACHE_LEN 8
+
+//Run of file blocks stored in consecutive blocks on the card
+struct extent {
+   uint32_t logical;    //First file block of the run
+   uint32_t physical;   //Card block holding it
+   uint16_t length;     //Number of blocks in the run
+};
+
+//Parts of an inode the player uses
+struct inode_entry {
+   uint32_t num;                    //Inode number, 0 if unused
+   uint32_t size;                   //Size in bytes
+   uint32_t block[EXT2_N_BLOCKS];   //Pointers to blocks
+   uint16_t mode;                   //File mode
+   uint8_t used;                    //Access count when last used
+};
+
+static struct inode_entry inodeCache[INODE_CACHE_LEN];
+static struct inode_entry *currentInode = inodeCache;
+static uint8_t inodeClock;
+
+//Filesystem layout from the superblock
+static uint32_t inodesPerGroup, numGroups, groupDescStart;
+static uint16_t blockSize;       //Bytes per block, 1024, 2048 or 4096
+static uint8_t blockShift;       //log2 of blockSize
+static uint8_t ptrShift;         //log2 of the block pointers per block
+static uint16_t inodeSize;       //Bytes per on-disk inode
+static uint8_t hasFileType;      //Directory entries record the file type
+static uint32_t inodeTables[GROUP_CACHE_LEN];
+typedef char groupCacheCheck[GROUP_CACHE_LEN *
+ sizeof(struct ext2_group_desc) <= 512 ? 1 : -1];
 
 static char name[NAME_LEN];
 static uint32_t filePos;
-
-static uint32_t fileOffsets[MAX_FILES];
+static uint32_t dataStart, dataEnd;    //Part of the file that is played
+
+static struct track tracks[MAX_TRACKS];
+static uint8_t numTracks;
+static uint32_t dirs[MAX_DIRS];
+static uint8_t numDirs;
+static uint8_t skippedTracks;    //Left out with the index full, up to 255
+static uint8_t skippedDirs;
+static uint32_t indexInode;   //Track index file the tracks came from
+
+//Window of block pointers from the last indirect block read
+static uint32_t ptrCache[PTR_CACHE_LEN];
+static uint32_t ptrCacheBlock;   //Indirect block of the window, 0 if none
+static uint32_t ptrCacheStart;   //Index of the first pointer in the window
+
+//Last pointer read from a double and a triple indirect block
+static uint32_t dindBlock, dindIndex, dindChild;
+static uint32_t tindBlock, tindIndex, tindChild;
+
+static uint32_t cacheHits, cacheMisses;
+
+//Block map of the open file, blocks past extentEnd are looked up on demand
+static struct extent extents[MAX_EXTENTS];
+static uint8_t numExtents, lastExtent;
+static uint32_t extentInode, extentEnd;
+
+//Card sector holding a byte of the filesystem, given as a block and a
+//byte offset from the start of that block
+static uint32_t blockSector(uint32_t block, uint32_t offset) {
+   return (block << (blockShift - 9)) + (offset >> 9);
+}
 
 uint32_t getIndirect(uint32_t address, uint32_t index) {
-   address *= 1024;
-   address += index * 4;
-   sdReadData(address / 512, address % 512, (void *) &address, 4);
-   return address;
+   uint32_t start = index & ~(uint32_t)(PTR_CACHE_LEN - 1);
+
+   if (address != ptrCacheBlock || start != ptrCacheStart) {
+      ptrCacheBlock = address;
+      ptrCacheStart = start;
+
+      sdReadData(blockSector(address, start * 4), (start * 4) % 512,
+       (void *) ptrCache, sizeof(ptrCache));
+      cacheMisses++;
+   } else {
+      cacheHits++;
+   }
+
+   return ptrCache[index % PTR_CACHE_LEN];
 }
 
 uint32_t getDIndirect(uint32_t address, uint32_t index) {
-   address *= 1024;
-   address += (index / 256) * 4;
-   sdReadData(address / 512, address % 512, (void *) &address, 4);
-   return getIndirect(address, index % 256);
+   if (address != dindBlock || index >> ptrShift != dindIndex) {
+      dindBlock = address;
+      dindIndex = index >> ptrShift;
+
+      sdReadData(blockSector(address, dindIndex * 4), (dindIndex * 4) % 512,
+       (void *) &dindChild, 4);
+      cacheMisses++;
+   } else {
+      cacheHits++;
+   }
+
+   return getIndirect(dindChild, index & ((1UL << ptrShift) - 1));
 }
 
 uint32_t getTIndirect(uint32_t address, uint32_t index) {
-   address *= 1024;
-   address += (index / (DIN_LEN)) * 4;
-   sdReadData(address / 512, address % 512, (void *) &address, 4);
-   return getDIndirect(address, index % (DIN_LEN));
+   if (address != tindBlock || index >> (2 * ptrShift) != tindIndex) {
+      tindBlock = address;
+      tindIndex = index >> (2 * ptrShift);
+
+      sdReadData(blockSector(address, tindIndex * 4), (tindIndex * 4) % 512,
+       (void *) &tindChild, 4);
+      cacheMisses++;
+   } else {
+      cacheHits++;
+   }
+
+   return getDIndirect(tindChild, index & ((1UL << (2 * ptrShift)) - 1));
 }
 
-uint32_t getBlockAddr(uint32_t offset) {
-   uint32_t index = offset / 1024;
-   uint32_t blockAddr;
+//Walk the block pointers of the current inode
+uint32_t lookupBlock(uint32_t index) {
+   uint32_t blockAddr, ptrs = 1UL << ptrShift;
 
    if (index < EXT2_NDIR_BLOCKS) {
-      blockAddr = currentInode.i_block[index];
+      blockAddr = currentInode->block[index];
    } else {
       index -= EXT2_NDIR_BLOCKS;
-      if (index < 256) {
-         blockAddr = getIndirect(currentInode.i_block[EXT2_IND_BLOCK], index);
+      if (index < ptrs) {
+         blockAddr = getIndirect(currentInode->block[EXT2_IND_BLOCK], index);
       } else {
-         index -= 256;
-         if (index < DIN_LEN) {
-            blockAddr = getDIndirect(currentInode.i_block[EXT2_DIND_BLOCK], index);
+         index -= ptrs;
+         if (index < ptrs * ptrs) {
+            blockAddr = getDIndirect(currentInode->block[EXT2_DIND_BLOCK], index);
          } else {
-            index -= DIN_LEN;
-            if (index < TIN_LEN) {
-               blockAddr = getTIndirect(currentInode.i_block[EXT2_TIND_BLOCK], index);
+            index -= ptrs * ptrs;
+            if (index < ptrs * ptrs * ptrs) {
+               blockAddr = getTIndirect(currentInode->block[EXT2_TIND_BLOCK], index);
             } else {
                return 0;
             }
@@ -60,65 +156,295 @@ uint32_t getBlockAddr(uint32_t offset) {
       }
    }
 
-   blockAddr *= 1024;
-   blockAddr += offset % 1024;
-
    return blockAddr;
 }
 
-void getBlockData(uint32_t offset, void *data, uint16_t size) {
-   if ((offset % 1024) + size > 1024) {
-      uint16_t pre = 1024 - (offset % 1024);
-      getBlockData(offset, data, pre);
-      getBlockData(offset + pre, (void *) (((char *) data) + pre), size - pre);
-      return;
+//Map the blocks of the current inode to runs, as far as MAX_EXTENTS go
+void buildExtents() {
+   uint32_t blocks = (currentInode->size + blockSize - 1) >> blockShift;
+   uint32_t index, blockAddr;
+   struct extent *e = extents;
+
+   numExtents = lastExtent = 0;
+   extentInode = currentInode->num;
+
+   for (index = 0; index < blocks; index++) {
+      blockAddr = lookupBlock(index);
+
+      if (numExtents && e->physical + e->length == blockAddr &&
+       e->length != 0xFFFF) {
+         e->length++;
+      } else {
+         if (numExtents == MAX_EXTENTS)
+            break;
+         e = &extents[numExtents++];
+         e->logical = index;
+         e->physical = blockAddr;
+         e->length = 1;
+      }
    }
 
-   uint32_t blockAddr = getBlockAddr(offset);
-   
-   if ((blockAddr % 512) + size > 512) {
-      uint16_t pre = 512 - (blockAddr % 512);
-      sdReadData(blockAddr / 512, blockAddr % 512, data, pre);
-      sdReadData((blockAddr / 512) + 1, 0, (void *)(((char *) data) + pre), size - pre);
-   } else {
-      sdReadData(blockAddr / 512, blockAddr % 512, data, size);
+   extentEnd = index;
+}
+
+//Card block of a file block, from the extent map if it covers the block
+uint32_t getBlockNum(uint32_t index) {
+   struct extent *e;
+   uint8_t i;
+
+   if (currentInode->num != extentInode || index >= extentEnd)
+      return lookupBlock(index);
+
+   //Sequential reads stay in the run used last time
+   for (i = 0; i < numExtents; i++) {
+      e = &extents[lastExtent];
+      if (index >= e->logical && index - e->logical < e->length)
+         return e->physical + (index - e->logical);
+      if (++lastExtent == numExtents)
+         lastExtent = 0;
    }
+
+   return lookupBlock(index);
+}
+
+//Card sector holding a byte of the current file, the byte is at
+//offset % 512 in that sector
+uint32_t getFileSector(uint32_t offset) {
+   return blockSector(getBlockNum(offset >> blockShift),
+    offset & (blockSize - 1));
+}
+
+//Read from the current inode, keeping the multiple block read going while
+//its blocks are contiguous on the card
+void getBlockData(uint32_t offset, void *data, uint16_t size) {
+   uint32_t sector;
+   uint16_t n;
+
+   while (size) {
+      n = blockSize - (offset & (blockSize - 1));
+      if (n > size)
+         n = size;
+
+      sector = getFileSector(offset);
+      if (!sdStreamSeek(sector, offset % 512))
+         sdStreamStart(sector, offset % 512);
+      sdStreamRead(data, n);
+
+      data = (void *)((char *) data + n);
+      offset += n;
+      size -= n;
+   }
+}
+
+//First block of the inode table of a group
+uint32_t getInodeTable(uint32_t group) {
+   uint32_t offset, table;
+
+   if (group < GROUP_CACHE_LEN)
+      return inodeTables[group];
+
+   offset = group * sizeof(struct ext2_group_desc) +
+    offsetof(struct ext2_group_desc, bg_inode_table);
+   sdReadData(blockSector(groupDescStart, offset), offset % 512,
+    (void *) &table, 4);
+
+   return table;
+}
+
+//Card sector and sector offset of a field of an on-disk inode
+static uint32_t inodeSector(uint32_t inode, uint8_t field) {
+   uint32_t offset = (uint32_t)inodeSize * ((inode - 1) % inodesPerGroup);
+
+   return blockSector(getInodeTable((inode - 1) / inodesPerGroup),
+    offset + field);
+}
+
+static uint16_t inodeOffset(uint32_t inode, uint8_t field) {
+   return ((uint32_t)inodeSize * ((inode - 1) % inodesPerGroup) + field) % 512;
+}
+
+//Modification time of an inode, read on its own so the cache is untouched
+static uint32_t getInodeMtime(uint32_t inode) {
+   uint32_t mtime;
+
+   sdReadData(inodeSector(inode, offsetof(struct ext2_inode, i_mtime)),
+    inodeOffset(inode, offsetof(struct ext2_inode, i_mtime)),
+    (void *) &mtime, 4);
+
+   return mtime;
 }
 
+//Make an inode current, reading it from the card unless it is cached
 void getInode(uint32_t inode) {
-   if (inode == currentInodeNum)
-      return;
+   struct inode_entry *e, *victim = inodeCache;
+   uint32_t sector;
+   uint16_t offset;
+   uint8_t i;
+
+   inodeClock++;
+
+   for (i = 0; i < INODE_CACHE_LEN; i++) {
+      e = &inodeCache[i];
+      if (e->num == inode) {
+         e->used = inodeClock;
+         currentInode = e;
+         return;
+      }
+      //Replace a free entry, else the one unused for longest
+      if (victim->num && (!e->num ||
+       (uint8_t)(inodeClock - e->used) > (uint8_t)(inodeClock - victim->used)))
+         victim = e;
+   }
 
-   uint32_t inodesPerGroup;
-   sdReadData(2, 40, (void *) &inodesPerGroup, 4);
+   //Pick the fields out of the on-disk inode in one single block read,
+   //an inode never spans two sectors
+   sector = inodeSector(inode, 0);
+   offset = inodeOffset(inode, 0);
+   sdPartialBlockRead(1);
+   sdReadData(sector, offset, (void *) &victim->mode, 2);
+   sdReadData(sector, offset + 4, (void *) &victim->size, 4);
+   sdReadData(sector, offset + offsetof(struct ext2_inode, i_block),
+    (void *) victim->block, sizeof(victim->block));
+   sdPartialBlockRead(0);
+
+   victim->num = inode;
+   victim->used = inodeClock;
+   currentInode = victim;
+}
 
-   uint32_t group = (inode - 1) / inodesPerGroup;
-   uint32_t address = 1024 * (8192 * group + 5) + 128 * ((inode - 1) % inodesPerGroup);
+//Type of a directory entry, EXT2_FT_*.  Filesystems without the filetype
+//feature only have it in the inode, dir is made current again after.
+static uint8_t entryType(struct ext2_dir_entry_2 *de, uint32_t dir) {
+   uint8_t type;
 
-   sdReadData(address / 512, address % 512, (void *) &currentInode, 128);
+   if (hasFileType)
+      return de->file_type;
 
-   currentInodeNum = inode;
+   getInode(de->inode);
+   type = currentInode->mode >> 12;
+   getInode(dir);
+
+   return type == 8 ? EXT2_FT_REG_FILE :
+    type == 4 ? EXT2_FT_DIR : EXT2_FT_UNKNOWN;
 }
 
-uint8_t inodeIsFile(uint32_t inode) {
-   getInode(inode);
-   return currentInode.i_mode >> 12 == 8;
+static uint16_t nameHash(char *s, uint8_t len) {
+   uint16_t hash = 5381;
+
+   while (len--)
+      hash = (hash << 5) + hash + *s++;
+
+   return hash;
 }
 
-void getFile(uint8_t ndx) {
-   uint32_t nextInode;
-   uint16_t nameLen;
+//Compare the name of the directory entry at offset with s
+static uint8_t entryNameIs(uint32_t offset, char *s, uint8_t len) {
+   char buf[8];
+   uint8_t n;
+
+   for (offset += 8; len; len -= n, s += n, offset += n) {
+      n = len < sizeof(buf) ? len : sizeof(buf);
+      getBlockData(offset, buf, n);
+      if (memcmp(buf, s, n))
+         return 0;
+   }
+
+   return 1;
+}
+
+//Inode of a path such as "music/a.wav" below the root directory, 0 if
+//it does not exist
+uint32_t lookupPath(char *path) {
+   struct ext2_dir_entry_2 de;
+   uint32_t inode = EXT2_ROOT_INO, offset;
+   char *end;
+   uint8_t len;
+
+   while (*path) {
+      while (*path == '/')
+         path++;
+      for (end = path; *end && *end != '/'; end++)
+         ;
+      if (end == path)
+         break;
+      len = end - path;
+
+      getInode(inode);
+      if (currentInode->mode >> 12 != 4)
+         return 0;
+
+      for (offset = 0; offset < currentInode->size; offset += de.rec_len) {
+         getBlockData(offset, &de, 8);
+         if (de.rec_len < 8)
+            return 0;
+         if (de.inode && de.name_len == len && entryNameIs(offset, path, len))
+            break;
+      }
+      if (offset >= currentInode->size)
+         return 0;
+
+      inode = de.inode;
+      path = end;
+   }
+
+   return inode;
+}
+
+//First card sector of a file to be written in place, with the number of
+//sectors in the run of contiguous blocks it starts with, at most the file
+//size.  Returns 0 if there is no such file.  Call it before a track is
+//opened, it changes the current inode.
+uint32_t getFileRun(char *path, uint16_t *sectors) {
+   uint32_t inode, first, blocks, n, size;
+
+   *sectors = 0;
+   if (!(inode = lookupPath(path)))
+      return 0;
 
-   getInode(EXT2_ROOT_INO);
+   getInode(inode);
+   size = currentInode->size;
+   blocks = (size + blockSize - 1) >> blockShift;
+   if (!blocks || !(first = lookupBlock(0)))
+      return 0;
+
+   for (n = 1; n < blocks && lookupBlock(n) == first + n; n++)
+      ;
 
-   getBlockData(fileOffsets[ndx], &nextInode, 4);
-   getBlockData(fileOffsets[ndx] + 6, &nameLen, 2);
-   getBlockData(fileOffsets[ndx] + 8, name, nameLen);
+   n <<= blockShift - 9;
+   size = (size + 511) >> 9;
+   if (n > size)
+      n = size;
+   *sectors = n > 0xFFFF ? 0xFFFF : n;
+
+   return blockSector(first, 0);
+}
 
+//Open a track of the index, only now is its name read
+void getFile(uint8_t ndx) {
+   struct track *t = &tracks[ndx];
+   uint8_t nameLen;
+
+   getInode(t->dir == INDEX_DIR ? indexInode : dirs[t->dir]);
+   getBlockData(t->offset, &nameLen, 1);
+   if (nameLen >= NAME_LEN)
+      nameLen = NAME_LEN - 1;
+   getBlockData(t->offset + 2, name, nameLen);
    name[nameLen] = 0;
-   filePos = 0;
 
-   getInode(nextInode);
+   getInode(t->inode);
+   buildExtents();
+   setFileData(0, currentInode->size);
+}
+
+//Limit playback to size bytes of the open file starting at offset
+void setFileData(uint32_t offset, uint32_t size) {
+   dataStart = filePos = offset;
+   dataEnd = offset + size;
+}
+
+//Move playback to pos bytes into the data, the start if it is past the end
+void setFilePos(uint32_t pos) {
+   filePos = dataStart + (pos < dataEnd - dataStart ? pos : 0);
 }
 
 char *getCurrentName() {
@@ -126,44 +452,227 @@ char *getCurrentName() {
 }
 
 uint32_t getCurrentPos() {
-   return filePos;
+   return filePos - dataStart;
 }
 
 uint32_t getCurrentSize() {
-   return currentInode.i_size;
+   return dataEnd - dataStart;
+}
+
+uint32_t getBlockCacheHits() {
+   return cacheHits;
 }
 
-void getFileChunk(uint8_t *buffer) {   
-   uint32_t addr = getBlockAddr(filePos);
-   sdReadData(addr / 512, addr % 512, buffer, 256);
+uint32_t getBlockCacheMisses() {
+   return cacheMisses;
+}
+
+//Read the next count bytes of the file data, looping back to its start
+void getFileChunk(uint8_t *buffer, uint16_t count) {
+   uint16_t n;
+
+   bench_begin(BENCH_CHUNK);
 
-   if ((filePos += 256) > currentInode.i_size) {
-      filePos = 0;
+   //Nothing to play, output silence
+   if (dataEnd == dataStart) {
+      memset(buffer, 128, count);
+      bench_end(BENCH_CHUNK);
+      return;
    }
+
+   while (count) {
+      //Stop at the end of the data
+      n = count;
+      if (n > dataEnd - filePos)
+         n = dataEnd - filePos;
+
+      getBlockData(filePos, buffer, n);
+
+      buffer += n;
+      count -= n;
+
+      if ((filePos += n) >= dataEnd)
+         filePos = dataStart;
+   }
+
+   bench_end(BENCH_CHUNK);
 }
 
+//Index the regular files of the root directory and of the directories
+//below it, in the order they are stored.  Directories found are queued in
+//dirs and scanned in turn, so there is no recursion.
 uint8_t getNumFiles() {
-   getInode(EXT2_ROOT_INO);
+   struct ext2_dir_entry_2 de;
+   struct track *t;
+   uint32_t offset;
+   uint8_t d, type, len;
+
+   numTracks = 0;
+   numDirs = 1;
+   dirs[0] = EXT2_ROOT_INO;
+   indexInode = 0;
+   skippedTracks = skippedDirs = 0;
+
+   for (d = 0; d < numDirs; d++) {
+      getInode(dirs[d]);
+
+      for (offset = 0; offset < currentInode->size; offset += de.rec_len) {
+         getBlockData(offset, &de, 8);
+         if (de.rec_len < 8)
+            break;
+         if (!de.inode || !de.name_len)
+            continue;
+
+         //The name buffer is free until a track is opened.  Hidden entries
+         //are skipped, which also covers . and .. and the track index.
+         len = de.name_len < NAME_LEN ? de.name_len : NAME_LEN - 1;
+         getBlockData(offset + 8, name, len);
+         if (name[0] == '.')
+            continue;
+         type = entryType(&de, dirs[d]);
+
+         //Entries past the end of the index, and files too far into a
+         //directory for the 16 bit name offset, are counted rather than
+         //dropped silently so the shortfall can be reported
+         if (type == EXT2_FT_DIR) {
+            if (numDirs < MAX_DIRS)
+               dirs[numDirs++] = de.inode;
+            else if (skippedDirs < 0xFF)
+               skippedDirs++;
+         } else if (type == EXT2_FT_REG_FILE && (numTracks == MAX_TRACKS ||
+          offset + offsetof(struct ext2_dir_entry_2, name_len) > 0xFFFF)) {
+            if (skippedTracks < 0xFF)
+               skippedTracks++;
+         } else if (type == EXT2_FT_REG_FILE) {
+            t = &tracks[numTracks++];
+            t->inode = de.inode;
+            t->offset = offset + offsetof(struct ext2_dir_entry_2, name_len);
+            t->hash = nameHash(name, len);
+            t->dir = d;
+         }
+      }
+   }
 
-   uint32_t offset = 0, nextInode;
-   uint16_t recLen;
-   uint8_t numFiles = 0;
+   memset(name, 0, NAME_LEN);
+   return numTracks;
+}
 
-   while (offset < currentInode.i_size) {
-      getBlockData(offset, &nextInode, 4);
-      getBlockData(offset + 4, &recLen, 2);
+//Load the track index file written by sdhost -i.  It holds the tracks of
+//every directory in one sequential read, and is stale once any of those
+//directories changed after it was written.  Returns the number of tracks,
+//or 0 if there is no usable index and getNumFiles has to scan.
+uint8_t loadTrackIndex() {
+   struct index_head head;
+   struct index_track rec;
+   struct track *t;
+   uint32_t inode, mtime, offset;
+   uint8_t i;
+
+   numTracks = 0;
+   if (!(inode = lookupPath(INDEX_PATH)))
+      return 0;
 
-      if (inodeIsFile(nextInode))
-         fileOffsets[numFiles++] = offset;
+   getInode(inode);
+   getBlockData(0, &head, sizeof(head));
+   if (head.magic != INDEX_MAGIC || !head.numDirs ||
+    head.numDirs > MAX_DIRS || head.numTracks > MAX_TRACKS)
+      return 0;
+
+   getBlockData(sizeof(head), (void *) dirs, head.numDirs * 4);
+   offset = sizeof(head) + head.numDirs * 4;
+
+   for (i = 0; i < head.numTracks; i++) {
+      if (offset + sizeof(rec) > currentInode->size)
+         return 0;
+      getBlockData(offset, &rec, sizeof(rec));
+
+      t = &tracks[i];
+      t->inode = rec.inode;
+      t->offset = offset + offsetof(struct index_track, nameLen);
+      t->hash = rec.hash;
+      t->dir = INDEX_DIR;
+      offset += sizeof(rec) + rec.nameLen;
+   }
 
-      getInode(EXT2_ROOT_INO);
-      offset += recLen;
+   mtime = getInodeMtime(inode);
+   for (i = 0; i < head.numDirs; i++) {
+      if (getInodeMtime(dirs[i]) > mtime)
+         return 0;
    }
 
-   return numFiles;
+   indexInode = inode;
+   numDirs = head.numDirs;
+   numTracks = head.numTracks;
+   skippedTracks = head.skippedTracks;
+   skippedDirs = head.skippedDirs;
+
+   return numTracks;
 }
 
-void ext2_init() {
-   memset(name, 0, NAME_LEN);
+//Track of the index, for tools that write it out
+struct track *getTrack(uint8_t ndx) {
+   return &tracks[ndx];
+}
+
+uint8_t getNumDirs() {
+   return numDirs;
+}
+
+//Files left out of the index because it was full
+uint8_t getSkippedTracks() {
+   return skippedTracks;
+}
+
+//Directories left unsearched because the list of them was full, the
+//files in them are not counted
+uint8_t getSkippedDirs() {
+   return skippedDirs;
+}
+
+uint32_t getDirInode(uint8_t ndx) {
+   return dirs[ndx];
 }
 
+//Read the filesystem layout, returns 0 if the card does not hold ext2
+uint8_t ext2_init() {
+   struct ext2_super_block sb;
+   uint32_t i;
+
+   memset(name, 0, NAME_LEN);
+
+   ptrCacheBlock = dindBlock = tindBlock = 0;
+   extentInode = 0;
+   cacheHits = cacheMisses = 0;
+   memset(inodeCache, 0, sizeof(inodeCache));
+   currentInode = inodeCache;
+
+   sdReadData(2, 0, (void *) &sb, sizeof(sb));
+   if (sb.s_magic != EXT2_SUPER_MAGIC || !sb.s_inodes_per_group ||
+    sb.s_log_block_size > EXT2_MAX_LOG_BLOCK_SIZE)
+      return 0;
+
+   blockShift = 10 + sb.s_log_block_size;
+   blockSize = 1 << blockShift;
+   ptrShift = blockShift - 2;
+   inodeSize = sb.s_rev_level == EXT2_GOOD_OLD_REV ?
+    EXT2_GOOD_OLD_INODE_SIZE : sb.s_inode_size;
+   hasFileType = sb.s_rev_level != EXT2_GOOD_OLD_REV &&
+    (sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE);
+
+   inodesPerGroup = sb.s_inodes_per_group;
+   numGroups = (sb.s_blocks_count - sb.s_first_data_block +
+    sb.s_blocks_per_group - 1) / sb.s_blocks_per_group;
+   groupDescStart = sb.s_first_data_block + 1;
+
+   //Keep the inode table block of the first groups, their descriptors
+   //share the first sector
+   sdPartialBlockRead(1);
+   for (i = 0; i < numGroups && i < GROUP_CACHE_LEN; i++)
+      sdReadData(blockSector(groupDescStart, 0), i *
+       sizeof(struct ext2_group_desc) +
+       offsetof(struct ext2_group_desc, bg_inode_table),
+       (void *) &inodeTables[i], 4);
+   sdPartialBlockRead(0);
+
+   return 1;
+}
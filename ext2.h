@@ -17,7 +17,8 @@
  #include <inttypes.h>
 
  #define NAME_LEN 75
- #define MAX_FILES 13
+ #define MAX_TRACKS 32   //Files kept in the track index
+ #define MAX_DIRS 8      //Directories searched for tracks, root included
 
 /*
  * Special inode numbers
@@ -137,15 +138,36 @@ struct ext2_super_block {
    uint32_t	s_rev_level;		/* Revision level */
    uint16_t	s_def_resuid;		/* Default uid for reserved blocks */
    uint16_t	s_def_resgid;		/* Default gid for reserved blocks */
+   /*
+    * These fields are for EXT2_DYNAMIC_REV superblocks only.
+    */
+   uint32_t	s_first_ino; 		/* First non-reserved inode */
+   uint16_t	s_inode_size; 		/* size of inode structure */
+   uint16_t	s_block_group_nr; 	/* block group # of this superblock */
+   uint32_t	s_feature_compat; 	/* compatible feature set */
+   uint32_t	s_feature_incompat; 	/* incompatible feature set */
+   uint32_t	s_feature_ro_compat; 	/* readonly-compatible feature set */
 };
 
+/*
+ * Feature set definitions
+ */
+#define EXT2_FEATURE_INCOMPAT_FILETYPE		0x0002
+
 /*
  * Revision levels
  */
 #define EXT2_GOOD_OLD_REV	0	/* The good old (original) format */
+#define EXT2_DYNAMIC_REV	1 	/* V2 format w/ dynamic inode sizes */
+
 #define EXT2_CURRENT_REV	EXT2_GOOD_OLD_REV
 #define EXT2_GOOD_OLD_INODE_SIZE 128
 
+/* Largest block size handled, 1024 << 2 */
+#define EXT2_MAX_LOG_BLOCK_SIZE	2
+
+#define EXT2_SUPER_MAGIC	0xEF53
+
 /*
  * Structure of a directory entry
  */
@@ -157,6 +179,20 @@ struct ext2_dir_entry {
    char	name[];			        /* File name, up to EXT2_NAME_LEN */
 };
 
+/*
+ * The new version of the directory entry.  Since EXT2 structures are
+ * stored in intel byte order, and the name_len field could never be
+ * bigger than 255 chars, it's safe to reclaim the extra byte for the
+ * file_type field.
+ */
+struct ext2_dir_entry_2 {
+   uint32_t	inode;			/* Inode number */
+   uint16_t	rec_len;		/* Directory entry length */
+   uint8_t	name_len;		/* Name length */
+   uint8_t	file_type;
+   char	name[];			        /* File name, up to EXT2_NAME_LEN */
+};
+
 /*
  * Ext2 directory file types.  Only the low 3 bits are used.  The
  * other bits are reserved for now.
@@ -173,18 +209,82 @@ enum {
    EXT2_FT_MAX
 };
 
+/*
+ * Track found by the directory scan or loaded from the track index.  Its
+ * name stays on the card until the track is opened.
+ */
+struct track {
+   uint32_t inode;      //Inode of the file
+   uint16_t offset;     //Name length byte, the name starts 2 bytes later
+   uint16_t hash;       //Hash of the name
+   uint8_t dir;         //Directory holding the name, INDEX_DIR if the index
+};
+
+#define INDEX_DIR 0xFF
+
+/*
+ * Track index file in the root directory, written by sdhost -i.  The
+ * header is followed by numDirs directory inode numbers, then numTracks
+ * records each followed by nameLen bytes of name.  Both structures have
+ * the same layout on the AVR and on the host.  The player only reads the
+ * index, it is built on the host and never rebuilt on the card.
+ */
+#define INDEX_PATH ".tracks"
+#define INDEX_MAGIC 0x32584954   /* "TIX2" */
+
+struct index_head {
+   uint32_t magic;
+   uint8_t numDirs;
+   uint8_t numTracks;
+   uint8_t skippedTracks;  //Left out, as getSkippedTracks() reports
+   uint8_t skippedDirs;
+};
+
+struct index_track {
+   uint32_t inode;
+   uint16_t hash;          //Name hash, as in struct track
+   uint8_t nameLen;        //Then a byte of padding as in a directory entry
+   uint8_t pad;
+};
+
+uint8_t loadTrackIndex();
+
+struct track *getTrack(uint8_t ndx);
+
+uint8_t getNumDirs();
+
+uint8_t getSkippedTracks();
+
+uint8_t getSkippedDirs();
+
+uint32_t getDirInode(uint8_t ndx);
+
 void getFile(uint8_t ndx);
 
+void setFileData(uint32_t offset, uint32_t size);
+
+void setFilePos(uint32_t pos);
+
+uint32_t lookupPath(char *path);
+
+uint32_t getFileRun(char *path, uint16_t *sectors);
+
+void getBlockData(uint32_t offset, void *data, uint16_t size);
+
 char *getCurrentName();
 
 uint32_t getCurrentPos();
 
 uint32_t getCurrentSize();
 
-void getFileChunk(uint8_t *buffer);
+uint32_t getBlockCacheHits();
+
+uint32_t getBlockCacheMisses();
+
+void getFileChunk(uint8_t *buffer, uint16_t count);
 
 uint8_t getNumFiles();
 
-void ext2_init();
+uint8_t ext2_init();
 
 #endif
@@ -0,0 +1,351 @@
+/*
+ * SPI mode SD card emulator for host builds.
+ *
+ * Each call to sdEmuTransfer() is one full duplex byte exchange: the byte
+ * the card drives on MISO comes from a queue of pending response bytes,
+ * and the byte from the host is collected into 6 byte command frames.
+ * Commands are answered after one byte of NCR, the same way a real card
+ * answers, so the polling loops in SdReader.c see realistic traffic.
+ *
+ * Written blocks go to the image file, each is followed by a few bytes of
+ * busy signalling so the write path polls like it would on a card.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "SdInfo.h"
+#include "SdEmu.h"
+
+//Longest response: gap byte, start token, 512 data bytes and 2 CRC bytes
+#define QUEUE_LEN 520
+
+//ACMD41 attempts answered with idle before the card reports ready
+#define INIT_TRIES 2
+
+//R1 parameter error bit, argument out of range
+#define R1_PARAM_ERROR 0X40
+
+//Bytes of busy after a block is received, before the card is ready
+#define BUSY_BYTES 4
+
+//Data response token for accepted data as the card sends it
+#define DATA_RES_TOKEN 0XE5
+
+//Bus time stands in for the system tick, a byte takes 1 us at 8 MHz
+#define BYTES_PER_TICK 1000
+
+sd_emu_stats_t sdEmuStats;
+
+static FILE *image_;
+static uint32_t blocks_;      //Card size in 512 byte blocks
+static uint8_t sdhc_;         //Block instead of byte addressing
+static uint8_t idle_;         //Idle until ACMD41 completes
+static uint8_t initTries_;
+static uint8_t appCmd_;       //Last command was CMD55
+
+static uint8_t cmd_[6];       //Command frame being received
+static uint8_t cmdLen_;
+
+static uint8_t queue_[QUEUE_LEN];
+static uint16_t head_, len_;
+
+static uint8_t streaming_;    //CMD18 open
+static uint32_t streamBlock_; //Next block of the CMD18 transfer
+
+static uint8_t writing_;      //CMD24 or CMD25 waiting for data, 0 if none
+static uint32_t writeBlock_;  //Block the next data packet goes to
+static uint8_t recv_[514];    //Data packet being received, data and CRC
+static uint16_t recvLen_;
+static uint8_t receiving_;    //Start token seen, collecting the packet
+
+static uint32_t transfers_;   //Bytes exchanged, selected or not
+
+static void put(uint8_t b) {
+   if (len_ < QUEUE_LEN)
+      queue_[len_++] = b;
+}
+
+static void flush(void) {
+   head_ = len_ = 0;
+}
+
+//Queue a data block: gap byte, start token, data, CRC
+static void putBlock(uint32_t block) {
+   put(0XFF);
+   put(DATA_START_BLOCK);
+
+   memset(queue_ + len_, 0, 512);
+   fseek(image_, (long)block * 512, SEEK_SET);
+   if (fread(queue_ + len_, 1, 512, image_)) {}
+   len_ += 512;
+
+   put(0XFF);
+   put(0XFF);
+
+   sdEmuStats.blocks++;
+}
+
+//Queue the card going busy and back to ready
+static void putBusy(void) {
+   uint8_t i;
+
+   for (i = 0; i < BUSY_BYTES; i++)
+      put(0X00);
+}
+
+//Take one byte of a write data transfer
+static void receive(uint8_t b) {
+   if (!receiving_) {
+      if (b == (writing_ == CMD24 ? DATA_START_BLOCK : WRITE_MULTIPLE_TOKEN)) {
+         receiving_ = 1;
+         recvLen_ = 0;
+      } else if (writing_ == CMD25 && b == STOP_TRAN_TOKEN) {
+         flush();
+         put(0XFF);
+         putBusy();
+         writing_ = 0;
+      }
+      return;
+   }
+
+   recv_[recvLen_++] = b;
+   if (recvLen_ < sizeof(recv_))
+      return;
+
+   fseek(image_, (long)writeBlock_ * 512, SEEK_SET);
+   fwrite(recv_, 1, 512, image_);
+   fflush(image_);
+   sdEmuStats.writes++;
+
+   flush();
+   put(DATA_RES_TOKEN);
+   putBusy();
+
+   receiving_ = 0;
+   writeBlock_++;
+   if (writing_ == CMD24)
+      writing_ = 0;
+}
+
+//Queue a 16 byte CID or CSD register
+static void putRegister(const uint8_t *reg) {
+   uint8_t i;
+
+   put(0XFF);
+   put(DATA_START_BLOCK);
+   for (i = 0; i < 16; i++)
+      put(reg[i]);
+   put(0XFF);
+   put(0XFF);
+}
+
+//Queue a version 2.0 CSD for the image size
+static void putCSD(void) {
+   uint32_t c_size = blocks_ / 1024 - 1;
+   uint8_t csd[16] = {0X40, 0X0E, 0X00, 0X32, 0X5B, 0X59, 0X00,
+    (c_size >> 16) & 0X3F, c_size >> 8, c_size,
+    0X7F, 0X80, 0X0A, 0X40, 0X00, 0X01};
+
+   putRegister(csd);
+}
+
+static void putCID(void) {
+   uint8_t cid[16] = {0X00, 'E', 'M', 'S', 'D', 'E', 'M', 'U', 0X10,
+    0X00, 0X00, 0X00, 0X01, 0X00, 0X01, 0X01};
+
+   putRegister(cid);
+}
+
+//Answer a complete command frame
+static void command(void) {
+   uint8_t cmd = cmd_[0] & 0X3F;
+   uint32_t arg = ((uint32_t)cmd_[1] << 24) | ((uint32_t)cmd_[2] << 16) |
+    ((uint32_t)cmd_[3] << 8) | cmd_[4];
+   uint8_t r1 = idle_ ? R1_IDLE_STATE : R1_READY_STATE;
+   uint8_t app = appCmd_;
+   uint32_t block;
+
+   sdEmuStats.commands++;
+   sdEmuStats.cmdCount[cmd]++;
+
+   //A new command ends any data still being sent
+   flush();
+   streaming_ = 0;
+   writing_ = 0;
+   appCmd_ = 0;
+
+   //NCR
+   put(0XFF);
+
+   if (app && cmd == ACMD41) {
+      if (initTries_) {
+         initTries_--;
+      } else {
+         idle_ = 0;
+         r1 = R1_READY_STATE;
+      }
+      put(r1);
+      return;
+   }
+
+   if (app && cmd == ACMD23) {
+      put(r1);
+      return;
+   }
+
+   switch (cmd) {
+   case CMD0:
+      idle_ = 1;
+      initTries_ = INIT_TRIES;
+      put(R1_IDLE_STATE);
+      break;
+   case CMD8:
+      put(r1);
+      put(0X00);
+      put(0X00);
+      put((arg >> 8) & 0X0F);
+      put(arg);
+      break;
+   case CMD9:
+      put(r1);
+      putCSD();
+      break;
+   case CMD10:
+      put(r1);
+      putCID();
+      break;
+   case CMD12:
+      put(r1);
+      break;
+   case CMD13:
+      put(r1);
+      put(0X00);
+      break;
+   case CMD17:
+   case CMD18:
+      block = sdhc_ ? arg : arg >> 9;
+      if (block >= blocks_) {
+         put(r1 | R1_PARAM_ERROR);
+         break;
+      }
+      put(r1);
+      putBlock(block);
+      if (cmd == CMD18) {
+         streaming_ = 1;
+         streamBlock_ = block + 1;
+      }
+      break;
+   case CMD24:
+   case CMD25:
+      block = sdhc_ ? arg : arg >> 9;
+      if (block >= blocks_) {
+         put(r1 | R1_PARAM_ERROR);
+         break;
+      }
+      put(r1);
+      writing_ = cmd;
+      writeBlock_ = block;
+      receiving_ = 0;
+      break;
+   case CMD55:
+      appCmd_ = 1;
+      put(r1);
+      break;
+   case CMD58:
+      put(r1);
+      put(sdhc_ ? 0XC0 : 0X80);
+      put(0XFF);
+      put(0X80);
+      put(0X00);
+      break;
+   default:
+      put(r1 | R1_ILLEGAL_COMMAND);
+      break;
+   }
+}
+
+/**
+ * Open an image file as the card contents.
+ *
+ * \param[in] path Image file.
+ * \param[in] sdhc Emulate a high capacity card with block addressing.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t sdEmuOpen(const char *path, uint8_t sdhc) {
+   sdEmuClose();
+
+   if (!(image_ = fopen(path, "r+b")) && !(image_ = fopen(path, "rb")))
+      return 0;
+
+   fseek(image_, 0, SEEK_END);
+   blocks_ = ftell(image_) / 512;
+   sdhc_ = sdhc;
+   idle_ = 1;
+   initTries_ = INIT_TRIES;
+   appCmd_ = 0;
+   cmdLen_ = 0;
+   streaming_ = 0;
+   writing_ = 0;
+   flush();
+   memset(&sdEmuStats, 0, sizeof(sdEmuStats));
+   return 1;
+}
+
+void sdEmuClose(void) {
+   if (image_)
+      fclose(image_);
+   image_ = NULL;
+}
+
+/**
+ * Exchange one byte with the card.
+ *
+ * \param[in] b Byte sent by the host on MOSI.
+ * \param[in] selected Chip select is asserted (SS low).
+ * \return Byte sent by the card on MISO.
+ */
+uint8_t sdEmuTransfer(uint8_t b, uint8_t selected) {
+   uint8_t out = 0XFF;
+
+   transfers_++;
+   if (!selected || !image_)
+      return out;
+
+   sdEmuStats.bytes++;
+
+   //Keep sending blocks until CMD12
+   if (head_ == len_ && streaming_) {
+      flush();
+      putBlock(streamBlock_++);
+      if (streamBlock_ >= blocks_)
+         streaming_ = 0;
+   }
+   if (head_ < len_)
+      out = queue_[head_++];
+
+   //Data of a write is not a command, a command frame outside a data packet
+   //still ends the write
+   if (writing_ && !cmdLen_ && (receiving_ || (b & 0XC0) != 0X40)) {
+      receive(b);
+      return out;
+   }
+
+   //Collect command frames, they start with bits 01
+   if (cmdLen_ || (b & 0XC0) == 0X40) {
+      cmd_[cmdLen_++] = b;
+      if (cmdLen_ == sizeof(cmd_)) {
+         cmdLen_ = 0;
+         command();
+      }
+   }
+
+   return out;
+}
+
+/**
+ * System tick for SdReader.c timeouts, derived from the bytes exchanged on
+ * the bus.
+ */
+uint32_t os_ticks(void) {
+   return transfers_ / BYTES_PER_TICK;
+}
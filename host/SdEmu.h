@@ -0,0 +1,32 @@
+/*
+ * SPI mode SD card emulator for host builds.
+ *
+ * The card contents come from a regular disk image file, so the SD and
+ * ext2 code can be run off-target against the same image that would be
+ * written to a real card.
+ */
+#ifndef SdEmu_h
+#define SdEmu_h
+#include <stdint.h>
+
+//Bus traffic counters, reset by sdEmuOpen()
+typedef struct {
+   uint32_t commands;         //Commands received
+   uint32_t cmdCount[64];     //Commands received by command index
+   uint32_t bytes;            //Bytes exchanged while the card was selected
+   uint32_t blocks;           //Data blocks started
+   uint32_t writes;           //Data blocks written
+} sd_emu_stats_t;
+
+extern sd_emu_stats_t sdEmuStats;
+
+uint8_t sdEmuOpen(const char *path, uint8_t sdhc);
+void sdEmuClose(void);
+uint8_t sdEmuTransfer(uint8_t b, uint8_t selected);
+
+//The OS calls SdReader.c makes, waits always spin on the host
+uint32_t os_ticks(void);
+#define os_running() 0
+#define thread_sleep(ticks) ((void)0)
+
+#endif //SdEmu_h
@@ -0,0 +1,11 @@
+/*
+ * Host build stand-in for <avr/interrupt.h>.
+ */
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define cli()
+#define sei()
+#define ISR(vector) void vector(void)
+
+#endif
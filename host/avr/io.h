@@ -0,0 +1,35 @@
+/*
+ * Host build stand-in for <avr/io.h>.
+ *
+ * Registers are plain variables defined in hostio.c, SPI data transfers
+ * are routed to the card emulator by SdReader.c.
+ */
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t SPCR;
+extern volatile uint8_t SPSR;
+extern volatile uint8_t SPDR;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t DDRB;
+
+//SPCR
+#define SPR0  0
+#define SPR1  1
+#define MSTR  4
+#define SPE   6
+
+//SPSR
+#define SPI2X 0
+#define SPIF  7
+
+//PORTB
+#define PB2   2
+#define PB3   3
+#define PB4   4
+#define PB5   5
+
+#endif
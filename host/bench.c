@@ -0,0 +1,199 @@
+/*
+ * Benchmark of the firmware running under simavr with an emulated card.
+ *
+ * usage: bench [-s] [-t seconds] firmware.elf image
+ *    -s          emulate a high capacity (SDHC) card
+ *    -t seconds  simulated time to run for, 10 by default
+ *
+ * The firmware is built with BENCH so the probes in bench.h drive port C
+ * pins around the code being measured.  Each pin is timed in CPU cycles
+ * and the totals are reported once the simulated time is up.  SPI bytes
+ * from the firmware go to SdEmu.c, the same card emulator sdhost uses.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_spi.h>
+#include <simavr/avr_uart.h>
+#include "SdEmu.h"
+#include "bench.h"
+
+#define F_CPU_HZ 16000000
+
+//Bytes getFileChunk reads per call, CHUNK_LEN in program5.c
+#define CHUNK_BYTES 32
+
+//The tick interrupt ends its probe just before it calls context_switch,
+//with interrupts still masked, so a switch that starts within this many
+//cycles of it is the tick's.  Threads switch when they block or sleep.
+#define TICK_TO_SWITCH 64
+
+typedef struct {
+   const char *name;
+   uint64_t start;   //Cycle the pin went high, 0 while low
+   uint64_t total;   //Cycles spent high
+   uint64_t max;     //Longest time high
+   uint32_t count;   //Times the pin went high
+} probe_t;
+
+static probe_t probes[] = {
+   [BENCH_SAMPLE] = {"sample interrupt"},
+   [BENCH_TICK] = {"tick interrupt"},
+   [BENCH_SWITCH] = {"context_switch"},
+   [BENCH_READ] = {"sdReadData"},
+   [BENCH_CHUNK] = {"getFileChunk"},
+   [BENCH_UNDERRUN] = {"underrun"},
+};
+#define NUM_PROBES (sizeof(probes) / sizeof(probes[0]))
+
+static uint64_t tickEnd;         //Cycle the tick probe last went low
+static uint8_t fromTick;         //The running switch was made by the tick
+static uint32_t tickSwitches;    //Switches made by the tick interrupt
+static uint64_t tickSwitchCycles;
+
+static avr_t *avr;
+static avr_irq_t *spiIn;
+static uint8_t selected;      //SS low
+
+static void usage(void) {
+   fprintf(stderr, "usage: bench [-s] [-t seconds] firmware.elf image\n");
+   exit(2);
+}
+
+static void probeChanged(avr_irq_t *irq, uint32_t value, void *param) {
+   probe_t *p = param;
+   uint64_t t;
+
+   if (value) {
+      p->start = avr->cycle;
+      p->count++;
+      if (p == &probes[BENCH_SWITCH])
+         fromTick = avr->cycle - tickEnd <= TICK_TO_SWITCH;
+   } else if (p->start) {
+      t = avr->cycle - p->start;
+      p->total += t;
+      if (t > p->max)
+         p->max = t;
+      p->start = 0;
+
+      if (p == &probes[BENCH_TICK])
+         tickEnd = avr->cycle;
+      if (p == &probes[BENCH_SWITCH] && fromTick) {
+         tickSwitches++;
+         tickSwitchCycles += t;
+      }
+   }
+}
+
+static void ssChanged(avr_irq_t *irq, uint32_t value, void *param) {
+   selected = !value;
+}
+
+//The firmware wrote SPDR, answer with the card's byte
+static void spiOut(avr_irq_t *irq, uint32_t value, void *param) {
+   avr_raise_irq(spiIn, sdEmuTransfer(value, selected));
+}
+
+static void report(uint64_t cycles) {
+   probe_t *p;
+   uint8_t i;
+
+   printf("%-18s %12llu (%.2f s)\n", "cycles",
+    (unsigned long long)cycles, (double)cycles / F_CPU_HZ);
+   for (i = 0; i < NUM_PROBES; i++) {
+      p = &probes[i];
+      if (i == BENCH_UNDERRUN)
+         continue;
+      printf("%-18s calls %9u avg %7.1f max %7llu duty %5.2f%%\n", p->name,
+       p->count, p->count ? (double)p->total / p->count : 0.0,
+       (unsigned long long)p->max, 100.0 * p->total / cycles);
+   }
+
+   p = &probes[BENCH_CHUNK];
+   printf("%-18s %12.1f\n", "cycles/sample", probes[BENCH_SAMPLE].count ?
+    (double)probes[BENCH_SAMPLE].total / probes[BENCH_SAMPLE].count : 0.0);
+   printf("%-18s %12.1f\n", "cycles/256 bytes", p->count ?
+    (double)p->total / p->count * 256 / CHUNK_BYTES : 0.0);
+   printf("%-18s %12u\n", "tick switches", tickSwitches);
+
+   //Switches threads make when they block are their own time
+   printf("%-18s %11.2f%%\n", "interrupt duty", 100.0 *
+    (probes[BENCH_SAMPLE].total + probes[BENCH_TICK].total +
+    tickSwitchCycles) / cycles);
+   printf("%-18s %12u\n", "underruns", probes[BENCH_UNDERRUN].count);
+}
+
+int main(int argc, char **argv) {
+   elf_firmware_t fw;
+   uint64_t end;
+   uint32_t flags = 0;
+   uint8_t sdhc = 0, i;
+   int opt, state, seconds = 10;
+
+   while ((opt = getopt(argc, argv, "st:")) != -1) {
+      if (opt == 's')
+         sdhc = 1;
+      else if (opt == 't')
+         seconds = atoi(optarg);
+      else
+         usage();
+   }
+   if (optind + 2 != argc || seconds <= 0)
+      usage();
+
+   memset(&fw, 0, sizeof(fw));
+   if (elf_read_firmware(argv[optind], &fw)) {
+      fprintf(stderr, "bench: cannot load %s\n", argv[optind]);
+      return 1;
+   }
+   strcpy(fw.mmcu, "atmega328p");
+   fw.frequency = F_CPU_HZ;
+
+   if (!sdEmuOpen(argv[optind + 1], sdhc)) {
+      fprintf(stderr, "bench: cannot open %s\n", argv[optind + 1]);
+      return 1;
+   }
+
+   avr = avr_make_mcu_by_name(fw.mmcu);
+   if (!avr) {
+      fprintf(stderr, "bench: no simavr core for %s\n", fw.mmcu);
+      return 1;
+   }
+   avr_init(avr);
+   avr_load_firmware(avr, &fw);
+
+   //The status screen is not of interest, keep it off stdout
+   avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+   flags &= ~AVR_UART_FLAG_STDIO;
+   avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+   //Card on the SPI bus, selected by PB2
+   spiIn = avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT);
+   avr_irq_register_notify(
+    avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), spiOut, NULL);
+   avr_irq_register_notify(
+    avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2), ssChanged, NULL);
+
+   for (i = 0; i < NUM_PROBES; i++)
+      avr_irq_register_notify(
+       avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('C'), i), probeChanged,
+       &probes[i]);
+
+   end = (uint64_t)seconds * F_CPU_HZ;
+   while (avr->cycle < end) {
+      state = avr_run(avr);
+      if (state == cpu_Done || state == cpu_Crashed) {
+         fprintf(stderr, "bench: firmware stopped at cycle %llu\n",
+          (unsigned long long)avr->cycle);
+         break;
+      }
+   }
+
+   report(avr->cycle);
+   sdEmuClose();
+   return 0;
+}
@@ -0,0 +1,10 @@
+/*
+ * Register variables for the host build, see avr/io.h.
+ */
+#include <avr/io.h>
+
+volatile uint8_t SPCR;
+volatile uint8_t SPSR;
+volatile uint8_t SPDR;
+volatile uint8_t PORTB;
+volatile uint8_t DDRB;
@@ -0,0 +1,238 @@
+/*
+ * Host build of the SD card and ext2 code running against an emulated
+ * card, used to count the SPI traffic of every read path.
+ *
+ * usage: sdhost [-s] [-i] [-d track] [-w sector] image
+ *    -s        emulate a high capacity (SDHC) card
+ *    -i        scan the directories and write the track index to stdout
+ *    -d track  write the contents of track (counting from 1) to stdout
+ *    -w sector check a multiple block write of WRITE_BLOCKS sectors from
+ *              sector, the old contents are written back after
+ *
+ * Without -d or -i every track is read once with getFileChunk and the
+ * command and byte counts are reported per track.
+ *
+ * The track index is copied to the card as .tracks in the root directory,
+ * for example with debugfs -w -R "write tracks.idx .tracks" image.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "globals.h"
+#include "ext2.h"
+#include "SdReader.h"
+#include "SdEmu.h"
+#include "wav.h"
+
+//Sectors the write check writes
+#define WRITE_BLOCKS 3
+
+static void usage(void) {
+   fprintf(stderr, "usage: sdhost [-s] [-i] [-d track] [-w sector] image\n");
+   exit(2);
+}
+
+static struct wav_format format;
+
+//Play the audio data of a track through once, writing it to out if it is
+//not null
+static uint32_t playTrack(uint8_t ndx, FILE *out) {
+   uint8_t buffer[256];
+   uint32_t pos, size, chunks = 0;
+
+   wavOpen(ndx, &format);
+   size = getCurrentSize();
+
+   for (pos = 0; pos < size; pos += sizeof(buffer)) {
+      getFileChunk(buffer, sizeof(buffer));
+      chunks++;
+      if (out)
+         fwrite(buffer, 1, size - pos < 256 ? size - pos : 256, out);
+   }
+
+   return chunks;
+}
+
+//Write the track index file for the tracks just scanned
+static void writeIndex(uint8_t numFiles, FILE *out) {
+   struct index_head head;
+   struct index_track rec;
+   uint32_t inode;
+   uint8_t i;
+
+   memset(&head, 0, sizeof(head));
+   head.magic = INDEX_MAGIC;
+   head.numDirs = getNumDirs();
+   head.numTracks = numFiles;
+   head.skippedTracks = getSkippedTracks();
+   head.skippedDirs = getSkippedDirs();
+   fwrite(&head, sizeof(head), 1, out);
+
+   for (i = 0; i < head.numDirs; i++) {
+      inode = getDirInode(i);
+      fwrite(&inode, 4, 1, out);
+   }
+
+   for (i = 0; i < numFiles; i++) {
+      getFile(i);
+
+      memset(&rec, 0, sizeof(rec));
+      rec.inode = getTrack(i)->inode;
+      rec.hash = getTrack(i)->hash;
+      rec.nameLen = strlen(getCurrentName());
+      fwrite(&rec, sizeof(rec), 1, out);
+      fwrite(getCurrentName(), 1, rec.nameLen, out);
+   }
+}
+
+static void printStats(const char *what, uint32_t audioBytes) {
+   double seconds = (double)audioBytes / format.byteRate;
+
+   fprintf(stderr, "%-24s cmds %6u (CMD17 %6u CMD18 %5u CMD12 %5u)"
+    " bus bytes %8u blocks %6u",
+    what, sdEmuStats.commands, sdEmuStats.cmdCount[CMD17],
+    sdEmuStats.cmdCount[CMD18], sdEmuStats.cmdCount[CMD12],
+    sdEmuStats.bytes, sdEmuStats.blocks);
+   if (seconds > 0)
+      fprintf(stderr, " cmds/s %.1f", sdEmuStats.commands / seconds);
+   fprintf(stderr, "\n");
+}
+
+//Write a run of sectors with one multiple block write, in pieces that do
+//not line up with the blocks, and read it back
+static uint8_t writeRun(uint32_t sector, const uint8_t *data) {
+   uint8_t back[WRITE_BLOCKS * 512];
+   uint16_t pos, n;
+   uint8_t i;
+
+   if (!sdWriteStart(sector, WRITE_BLOCKS))
+      return 0;
+   for (pos = 0; pos < sizeof(back); pos += n) {
+      n = sizeof(back) - pos < 100 ? sizeof(back) - pos : 100;
+      if (!sdWriteNext(data + pos, n))
+         return 0;
+   }
+   if (!sdWriteStop())
+      return 0;
+
+   for (i = 0; i < WRITE_BLOCKS; i++)
+      if (!sdReadBlock(sector + i, back + i * 512))
+         return 0;
+
+   return !memcmp(back, data, sizeof(back));
+}
+
+//Check the multiple block write, leaving the card as it was
+static int writeCheck(uint32_t sector) {
+   uint8_t old[WRITE_BLOCKS * 512], pattern[WRITE_BLOCKS * 512];
+   uint16_t i;
+
+   for (i = 0; i < WRITE_BLOCKS; i++)
+      if (!sdReadBlock(sector + i, old + i * 512)) {
+         fprintf(stderr, "cannot read sector %u\n", sector + i);
+         return 1;
+      }
+   for (i = 0; i < sizeof(pattern); i++)
+      pattern[i] = i * 7 + (i >> 9);
+
+   memset(&sdEmuStats, 0, sizeof(sdEmuStats));
+   if (!writeRun(sector, pattern)) {
+      fprintf(stderr, "write check failed, error 0x%02X\n", sdErrorCode());
+      return 1;
+   }
+   printStats("multiple block write", 0);
+   fprintf(stderr, "   blocks written %u\n", sdEmuStats.writes);
+
+   if (!writeRun(sector, old)) {
+      fprintf(stderr, "restoring sectors failed, error 0x%02X\n", sdErrorCode());
+      return 1;
+   }
+   fprintf(stderr, "write check passed\n");
+   return 0;
+}
+
+int main(int argc, char **argv) {
+   int opt, dump = 0, index = 0;
+   long write = -1;
+   uint8_t sdhc = 0, numFiles, i;
+   uint32_t chunks;
+
+   while ((opt = getopt(argc, argv, "sid:w:")) != -1) {
+      switch (opt) {
+      case 's':
+         sdhc = 1;
+         break;
+      case 'i':
+         index = 1;
+         break;
+      case 'd':
+         dump = atoi(optarg);
+         break;
+      case 'w':
+         write = atol(optarg);
+         break;
+      default:
+         usage();
+      }
+   }
+   if (optind != argc - 1)
+      usage();
+
+   if (!sdEmuOpen(argv[optind], sdhc)) {
+      perror(argv[optind]);
+      return 1;
+   }
+
+   if (!sdInit(0)) {
+      fprintf(stderr, "sdInit failed\n");
+      return 1;
+   }
+   if (write >= 0)
+      return writeCheck(write);
+   if (!ext2_init()) {
+      fprintf(stderr, "no ext2 filesystem\n");
+      return 1;
+   }
+   printStats("init", 0);
+
+   memset(&sdEmuStats, 0, sizeof(sdEmuStats));
+   if (!index && (numFiles = loadTrackIndex())) {
+      printStats("track index", 0);
+   } else {
+      numFiles = getNumFiles();
+      printStats("directory scan", 0);
+   }
+   if (getSkippedTracks() || getSkippedDirs())
+      fprintf(stderr, "index full: %u files and %u directories left out "
+       "(MAX_TRACKS %u, MAX_DIRS %u)\n", getSkippedTracks(), getSkippedDirs(),
+       MAX_TRACKS, MAX_DIRS);
+
+   if (index) {
+      writeIndex(numFiles, stdout);
+      return 0;
+   }
+
+   if (dump) {
+      if (dump > numFiles) {
+         fprintf(stderr, "no track %d\n", dump);
+         return 1;
+      }
+      playTrack(dump - 1, stdout);
+      return 0;
+   }
+
+   for (i = 0; i < numFiles; i++) {
+      memset(&sdEmuStats, 0, sizeof(sdEmuStats));
+      chunks = playTrack(i, NULL);
+      fprintf(stderr, "%u: %s, %u bytes, %u chunks, %u Hz %u bit %s\n",
+       i + 1, getCurrentName(), getCurrentSize(), chunks, format.sampleRate,
+       format.bits, format.channels == 2 ? "stereo" : "mono");
+      printStats("   playback", getCurrentSize());
+      fprintf(stderr, "   block cache hits %u misses %u\n",
+       getBlockCacheHits(), getBlockCacheMisses());
+   }
+
+   sdEmuClose();
+   return 0;
+}
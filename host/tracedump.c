@@ -0,0 +1,138 @@
+/*
+ * Decoder for the trace ring the player dumps over serial.
+ *
+ * usage: tracedump [capture]
+ *
+ * Reads a capture of the serial output, from the file or stdin, finds
+ * every dump in it (the status screen around them is skipped) and prints
+ * each as a timeline in milliseconds from its first event.  Timestamps
+ * wrap every 256 ticks, so a gap that long between two events reads as
+ * shorter than it was.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+static const char *names[] = {
+   [TRACE_SWITCH] = "switch",
+   [TRACE_MUTEX_WAIT] = "mutex wait",
+   [TRACE_MUTEX_PASS] = "mutex pass",
+   [TRACE_SD_CMD] = "sd cmd",
+   [TRACE_SD_R1] = "sd r1",
+   [TRACE_SD_DATA] = "sd data",
+   [TRACE_UNDERRUN] = "underrun",
+   [TRACE_LOW] = "low",
+   [TRACE_FULL] = "full",
+};
+#define NUM_NAMES (sizeof(names) / sizeof(names[0]))
+
+static void printArg(trace_t *e) {
+   switch (e->type) {
+   case TRACE_SWITCH:
+      printf("thread %u -> %u", e->arg & 0xF, e->arg >> 4);
+      break;
+   case TRACE_MUTEX_WAIT:
+      printf("thread %u waits for thread %u", e->arg & 0xF, e->arg >> 4);
+      break;
+   case TRACE_MUTEX_PASS:
+      printf("to thread %u", e->arg);
+      break;
+   case TRACE_SD_CMD:
+      printf("CMD%u", e->arg);
+      break;
+   case TRACE_SD_R1:
+   case TRACE_SD_DATA:
+      printf("0x%02X", e->arg);
+      break;
+   case TRACE_LOW:
+      printf("%u slots left", e->arg);
+      break;
+   case TRACE_FULL:
+      printf("after %u ticks", e->arg);
+      break;
+   }
+}
+
+//Print one dump, buf holds the header and len events
+static void decode(const uint8_t *buf, uint8_t len) {
+   uint8_t clockPerTick = buf[5], i;
+   uint16_t tickHz = buf[6] | buf[7] << 8;
+   uint32_t ticks = 0, first = 0, steps;
+   uint8_t lastTick = 0, started = 0;
+   trace_t e;
+
+   printf("trace of %u events\n", len);
+   buf += TRACE_HEAD_LEN;
+
+   for (i = 0; i < len; i++, buf += sizeof(trace_t)) {
+      e.type = buf[0];
+      e.arg = buf[1];
+      e.time = buf[2] | buf[3] << 8;
+
+      //Slot never written
+      if (!e.type)
+         continue;
+
+      //Unwrap the tick byte, events are in order
+      if (started && (e.time >> 8) < lastTick)
+         ticks += 256;
+      lastTick = e.time >> 8;
+      steps = (ticks + lastTick) * clockPerTick + (e.time & 0xFF);
+      if (!started) {
+         first = steps;
+         started = 1;
+      }
+
+      printf("%10.3f  %-10s  ", (steps - first) * 1000.0 / clockPerTick /
+       tickHz, e.type < NUM_NAMES && names[e.type] ? names[e.type] : "?");
+      printArg(&e);
+      printf("\n");
+   }
+}
+
+int main(int argc, char **argv) {
+   FILE *in = stdin;
+   uint8_t *buf;
+   size_t size = 0, cap = 1 << 16, n, i, need;
+   int dumps = 0;
+
+   if (argc > 2) {
+      fprintf(stderr, "usage: tracedump [capture]\n");
+      return 2;
+   }
+   if (argc == 2 && !(in = fopen(argv[1], "rb"))) {
+      perror(argv[1]);
+      return 1;
+   }
+
+   buf = malloc(cap);
+   while (buf && (n = fread(buf + size, 1, cap - size, in)) > 0)
+      if ((size += n) == cap)
+         buf = realloc(buf, cap *= 2);
+   if (!buf) {
+      fprintf(stderr, "tracedump: out of memory\n");
+      return 1;
+   }
+
+   for (i = 0; i + TRACE_HEAD_LEN <= size; i++) {
+      if (memcmp(buf + i, TRACE_MAGIC, 4))
+         continue;
+
+      need = TRACE_HEAD_LEN + buf[i + 4] * sizeof(trace_t);
+      if (i + need > size) {
+         fprintf(stderr, "tracedump: dump cut short\n");
+         break;
+      }
+
+      if (dumps++)
+         printf("\n");
+      decode(buf + i, buf[i + 4]);
+      i += need - 1;
+   }
+
+   if (!dumps)
+      fprintf(stderr, "tracedump: no trace found\n");
+   free(buf);
+   return !dumps;
+}
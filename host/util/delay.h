@@ -0,0 +1,11 @@
+/*
+ * Host build stand-in for <util/delay.h>, the emulated card never needs
+ * real time to pass.
+ */
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+#define _delay_us(us)
+#define _delay_ms(ms)
+
+#endif
@@ -1,23 +1,108 @@
+#include <avr/pgmspace.h>
 #include "globals.h"
 #include "os.h"
+#include "bench.h"
+#include "trace.h"
 
-//Get the the next "Ready" thread - Round robin
+extern uint8_t __heap_start;   //End of .data and .bss, from the linker
+
+//Thread stacks, handed out in order and never freed
+static uint8_t stackPool[STACK_POOL_SIZE];
+static uint16_t stackUsed;
+
+//Position of the lowest and of the highest set bit of a nibble
+static const uint8_t lowBit[16] PROGMEM =
+ {0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0};
+static const uint8_t highBit[16] PROGMEM =
+ {0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3};
+
+static uint8_t lowest_bit(uint8_t mask) {
+   if (mask & 0x0F)
+      return pgm_read_byte(&lowBit[mask & 0x0F]);
+   return 4 + pgm_read_byte(&lowBit[mask >> 4]);
+}
+
+static uint8_t highest_bit(uint8_t mask) {
+   if (mask & 0xF0)
+      return 4 + pgm_read_byte(&highBit[mask >> 4]);
+   return pgm_read_byte(&highBit[mask & 0x0F]);
+}
+
+//Get the next "Ready" thread and take it off the ready bitmap - highest
+//priority first, round robin within a priority
 uint8_t get_next_thread(void) {
-   uint8_t id;
+   uint8_t prio, mask, after, id;
+
+   if (!sysInfo.readyPrio)
+      return 0;
+
+   prio = highest_bit(sysInfo.readyPrio);
+   mask = sysInfo.ready[prio];
+
+   //Pick the first ready thread after the one that ran last
+   after = mask & (uint8_t)(0xFE << sysInfo.lastRun[prio]);
+   id = lowest_bit(after ? after : mask);
 
-   for (id = 1; id < sysInfo.numThreads; id++)
-      if (sysInfo.threads[id].state == THREAD_READY)
-         return id;
+   sysInfo.lastRun[prio] = id;
+   sysInfo.ready[prio] = mask & ~(1 << id);
+   if (!sysInfo.ready[prio])
+      sysInfo.readyPrio &= ~(1 << prio);
 
-   return 0;
+   return id;
 }
 
-//This interrupt routine is automatically run every 10 milliseconds
+//Clock steps since os_init(), interrupts must be disabled
+static uint32_t os_clock(void) {
+   uint8_t count = TCNT0;
+   uint32_t ticks = sysInfo.numIntr;
+
+   //The count already restarted for a tick not yet counted
+   if ((TIFR0 & _BV(OCF0A)) && count < CLOCK_PER_TICK / 2)
+      ticks++;
+
+   return ticks * CLOCK_PER_TICK + count;
+}
+
+//Record how much of the second that just ended the idle thread had.
+//Interrupt time is charged to the thread it interrupted, including the
+//idle thread, so this is an upper bound on the headroom left.
+static void load_sample(void) {
+   uint32_t idle = sysInfo.threads[0].cpuTime * CLOCK_PER_TICK +
+    sysInfo.threads[0].cpuSteps, pct;
+
+   if (sysInfo.curId == 0)
+      idle += os_clock() - sysInfo.switchAt;
+
+   pct = (idle - sysInfo.idleMark) / (CLOCK_PER_SEC / 100);
+   sysInfo.idleMark = idle;
+
+   sysInfo.idle[sysInfo.loadNext] = pct > 100 ? 100 : pct;
+   if (++sysInfo.loadNext == LOAD_SECS)
+      sysInfo.loadNext = 0;
+   if (sysInfo.loadCount < LOAD_SECS)
+      sysInfo.loadCount++;
+}
+
+//This interrupt routine is automatically run every millisecond
 ISR(TIMER0_COMPA_vect) {
    volatile uint8_t oldId = sysInfo.curId, i;
    volatile regs_interrupt *intr;
 
+   bench_begin(BENCH_TICK);
+
    sysInfo.numIntr++;
+   if (++sysInfo.secTicks == TICK_HZ) {
+      sysInfo.secTicks = 0;
+      sysInfo.runtime++;
+      if (sysInfo.started)
+         load_sample();
+   }
+
+   //Only keep time until there are threads to switch between
+   if (!sysInfo.started) {
+      bench_end(BENCH_TICK);
+      return;
+   }
 
    //Save interrupted PC (4 locals, 1 pad byte, 2 arguments)
    intr = (regs_interrupt *)(sysInfo.threads[oldId].tp +
@@ -31,34 +116,38 @@ ISR(TIMER0_COMPA_vect) {
    asm volatile ("" : : : "r18", "r19", "r20", "r21", "r22", "r23", "r24", \
                  "r25", "r26", "r27", "r30", "r31");
 
-   //Decrement sleep timer and check for any expired ones
-   for (i = 0; i < sysInfo.numThreads; i++) {
-      if (sysInfo.threads[i].state == THREAD_SLEEPING) {
-         if (--sysInfo.threads[i].sleep == 0)
-            sysInfo.threads[i].state = THREAD_READY;
+   //Only the head of the sleep queue counts down, wake it and every
+   //thread after it with the same deadline once it expires
+   if ((i = sysInfo.sleepHead) != NO_THREAD) {
+      if (sysInfo.threads[i].sleep)
+         sysInfo.threads[i].sleep--;
+
+      while (i != NO_THREAD && sysInfo.threads[i].sleep == 0) {
+         thread_ready(i);
+         i = sysInfo.threads[i].next;
       }
+      sysInfo.sleepHead = i;
    }
 
-   //Get the thread id of the next thread to run
-   sysInfo.threads[oldId].state = THREAD_READY;
+   //Get the thread id of the next thread to run.  Only a thread that was
+   //running goes back to ready, a blocked one waits for its wakeup.
+   if (sysInfo.threads[oldId].state == THREAD_RUNNING)
+      thread_ready(oldId);
    sysInfo.curId = get_next_thread();
    sysInfo.threads[sysInfo.curId].state = THREAD_RUNNING;
    sysInfo.threads[sysInfo.curId].sched_count++;
 
+   thread_charge(oldId);
+   bench_end(BENCH_TICK);
    context_switch(&sysInfo.threads[sysInfo.curId].tp,
     &sysInfo.threads[oldId].tp);
 }
 
-//This interrupt routine is run once a second
-//The 2 interrupt routines will not interrupt each other
-ISR(TIMER1_COMPA_vect) {
-
-   sysInfo.runtime++;
-}
-
 //new_tp: r25:24, old_tp: r23:r22
 __attribute__((naked)) void context_switch(uint16_t* new_tp, uint16_t* old_tp) {
 
+   bench_begin(BENCH_SWITCH);
+
    //Save registers in regs_context_switch to stack
    asm volatile ("PUSH r2\n"
                  "PUSH r3\n"
@@ -124,6 +213,7 @@ __attribute__((naked)) void context_switch(uint16_t* new_tp, uint16_t* old_tp) {
                  "POP r2");
 
    //return PC
+   bench_end(BENCH_SWITCH);
    asm volatile ("RET");
 
 }
@@ -142,56 +232,100 @@ __attribute__((naked)) void thread_start(void) {
    asm volatile ("IJMP");           //Jump to function
 }
 
+//Start switching threads, interrupts are enabled by the caller
 void os_start(void) {
+   uint8_t *p;
+
+   //Nothing may use the stack below this frame while it is painted
+   cli();
+
+   //The main thread owns the RAM between the heap start and the top of
+   //memory.  Paint what it has not used yet, staying clear of this frame.
+   for (p = &__heap_start; p < (uint8_t *)SP - STACK_MARGIN; p++)
+      *p = STACK_CANARY;
 
-   start_system_timer();
    clear_screen();
 
    //Setup main idle thread #0
    sysInfo.threads[0].id = 0;
-   sysInfo.threads[0].stackBase = 0x8FF;
-   sysInfo.threads[0].stackEnd = 0x0;
+   sysInfo.threads[0].stackBase = &__heap_start;
+   sysInfo.threads[0].stackEnd = (uint8_t *)RAMEND + 1;
    sysInfo.threads[0].userSize = 0x0;
    sysInfo.threads[0].pc = main;
+   sysInfo.threads[0].priority = PRIORITY_IDLE;
+   sysInfo.threads[0].basePriority = PRIORITY_IDLE;
    sysInfo.threads[0].state = THREAD_RUNNING;
    sysInfo.threads[0].sleep = 0;
    sysInfo.threads[0].sched_count = 0;
+   sysInfo.threads[0].cpuTime = 0;
+   sysInfo.threads[0].cpuSteps = 0;
    sysInfo.threads[0].intr_pcl = 0;
    sysInfo.threads[0].intr_pch = 0;
-   sysInfo.threads[0].totSize = 0x7FF;
+   sysInfo.threads[0].totSize = RAMEND + 1 - (uint16_t)&__heap_start;
 
    context_switch(&sysInfo.threads[0].tp, &sysInfo.threads[0].tp);
-   
+
+   //Measure load in whole seconds from here
+   sysInfo.secTicks = 0;
+   sysInfo.switchAt = os_clock();
+   sysInfo.idleMark = 0;
+   sysInfo.loadNext = 0;
+   sysInfo.loadCount = 0;
+   sysInfo.started = 1;
 }
 
+//Set up the OS and start the system tick, which only counts time until
+//os_start() so SD timeouts work before then
 void os_init() {
 
+   sysInfo.started = 0;
    sysInfo.runtime = 0;
    sysInfo.intrSec = 0;
    sysInfo.numThreads = 1;
    sysInfo.numIntr = 0;
+   sysInfo.secTicks = 0;
+   sysInfo.sleepHead = NO_THREAD;
+   sysInfo.readyPrio = 0;
+   stackUsed = 0;
+   memset(sysInfo.ready, 0, NUM_PRIORITIES);
+   memset(sysInfo.lastRun, 0, NUM_PRIORITIES);
    sysInfo.curId = 0;        //Start with main thread 0 (idle)
+   start_system_timer();
 }
 
-void create_thread(uint16_t address, void *args, uint16_t stack_size) {
+//Create a thread with its stack taken from the stack pool.  Returns the
+//thread id, or -1 if there is no free thread slot or the stack does not fit.
+int8_t create_thread(uint16_t address, void *args, uint16_t stack_size,
+ uint8_t priority) {
    uint8_t id;
+   uint16_t size = THREAD_STACK(stack_size);
+
+   if (sysInfo.numThreads >= MAX_THREADS || size > stack_pool_free())
+      return -1;
 
    id = sysInfo.numThreads++;   //Increment numThreads;
-   sysInfo.threads[id].totSize =
-    stack_size + sizeof(regs_context_switch) + sizeof(regs_interrupt) + 32;
+   sysInfo.threads[id].totSize = size;
 
    //Set thread info
    sysInfo.threads[id].id = id;
-   sysInfo.threads[id].stackBase = calloc(1, sysInfo.threads[id].totSize);
+   sysInfo.threads[id].stackBase = stackPool + stackUsed;
+   stackUsed += size;
    sysInfo.threads[id].userSize = stack_size;
    sysInfo.threads[id].pc = address;
+   sysInfo.threads[id].priority = priority;
+   sysInfo.threads[id].basePriority = priority;
    sysInfo.threads[id].sleep = 0;
    sysInfo.threads[id].sched_count = 0;
+   sysInfo.threads[id].cpuTime = 0;
+   sysInfo.threads[id].cpuSteps = 0;
    sysInfo.threads[id].intr_pcl = 0;
    sysInfo.threads[id].intr_pch = 0;
    sysInfo.threads[id].stackEnd =
     sysInfo.threads[id].stackBase + sysInfo.threads[id].totSize;
 
+   //Paint the stack so thread_stack_peak can find how deep it has been
+   memset(sysInfo.threads[id].stackBase, STACK_CANARY, size);
+
    //Put thread_start function address in PC
    *(sysInfo.threads[id].stackEnd - 1) = (uint8_t)(thread_start);
    *(sysInfo.threads[id].stackEnd - 2) =
@@ -201,16 +335,55 @@ void create_thread(uint16_t address, void *args, uint16_t stack_size) {
    *(sysInfo.threads[id].stackEnd - 3) = (uint8_t)(address);
    *(sysInfo.threads[id].stackEnd - 4) = (uint8_t)(address >> 8);
 
-   if (args != NULL) {
-      //Put function args in r5:r4
-      *(sysInfo.threads[id].stackEnd - 5) = (uint8_t)args;
-      *(sysInfo.threads[id].stackEnd - 6) = (uint8_t)((uint16_t)args >> 8);
-   }
+   //Put function args in r5:r4
+   *(sysInfo.threads[id].stackEnd - 5) = (uint8_t)args;
+   *(sysInfo.threads[id].stackEnd - 6) = (uint8_t)((uint16_t)args >> 8);
 
    //Store stack pointer, set thread state to ready
    sysInfo.threads[id].tp =
     (uint16_t)(sysInfo.threads[id].stackEnd - sizeof(regs_context_switch));
-   sysInfo.threads[id].state = THREAD_READY;
+   thread_ready(id);
+
+   return id;
+}
+
+//Deepest a thread's stack has been, found by counting the canary bytes
+//it never overwrote from the low end
+uint16_t thread_stack_peak(uint8_t id) {
+   uint8_t *p = sysInfo.threads[id].stackBase;
+
+   while (p < sysInfo.threads[id].stackEnd && *p == STACK_CANARY)
+      p++;
+
+   return sysInfo.threads[id].stackEnd - p;
+}
+
+//Bytes left in the stack pool
+uint16_t stack_pool_free(void) {
+   return STACK_POOL_SIZE - stackUsed;
+}
+
+//Insert a thread into the sleep queue.  Each entry stores its ticks
+//relative to the entry before it, so the tick interrupt only has to count
+//down the head.
+static void sleep_insert(uint8_t id, uint16_t ticks) {
+   uint8_t prev = NO_THREAD, cur = sysInfo.sleepHead;
+
+   while (cur != NO_THREAD && ticks >= sysInfo.threads[cur].sleep) {
+      ticks -= sysInfo.threads[cur].sleep;
+      prev = cur;
+      cur = sysInfo.threads[cur].next;
+   }
+
+   sysInfo.threads[id].sleep = ticks;
+   sysInfo.threads[id].next = cur;
+   if (cur != NO_THREAD)
+      sysInfo.threads[cur].sleep -= ticks;
+
+   if (prev == NO_THREAD)
+      sysInfo.sleepHead = id;
+   else
+      sysInfo.threads[prev].next = id;
 }
 
 void thread_sleep(uint16_t ticks) {
@@ -222,11 +395,111 @@ void thread_sleep(uint16_t ticks) {
    sysInfo.threads[oldId].intr_pcl = intr->pcl;
    sysInfo.threads[oldId].intr_pch = intr->pch;
    sysInfo.threads[oldId].state = THREAD_SLEEPING;
-   sysInfo.threads[oldId].sleep = ticks;
+   sleep_insert(oldId, ticks);
 
    sysInfo.curId = get_next_thread();
    sysInfo.threads[sysInfo.curId].state = THREAD_RUNNING;
+   thread_charge(oldId);
    context_switch(&sysInfo.threads[sysInfo.curId].tp,
     &sysInfo.threads[oldId].tp);
    sei();
 }
+
+//Sleep until an absolute tick count, periodic threads use the previous
+//deadline plus their period so they do not drift
+void thread_sleep_until(uint32_t tick) {
+   int32_t ticks;
+
+   while ((ticks = (int32_t)(tick - os_ticks())) > 0)
+      thread_sleep(ticks > 0xFFFF ? 0xFFFF : ticks);
+}
+
+//Ticks since os_init()
+uint32_t os_ticks(void) {
+   uint32_t ticks;
+   uint8_t sreg = SREG;
+
+   cli();
+   ticks = sysInfo.numIntr;
+   SREG = sreg;
+
+   return ticks;
+}
+
+//Charge the time since the last context switch to the thread being
+//switched out, called with interrupts disabled right before the switch.
+//Whole ticks move to the millisecond total, a count of clock steps would
+//wrap after under 5 hours.  The tick switches every millisecond, so the
+//loop rarely runs more than once.
+void thread_charge(uint8_t id) {
+   uint32_t now = os_clock();
+   uint32_t steps = sysInfo.threads[id].cpuSteps + (now - sysInfo.switchAt);
+
+   while (steps >= CLOCK_PER_TICK) {
+      steps -= CLOCK_PER_TICK;
+      sysInfo.threads[id].cpuTime++;
+   }
+   sysInfo.threads[id].cpuSteps = steps;
+   sysInfo.switchAt = now;
+
+   if (id != sysInfo.curId)
+      TRACE(TRACE_SWITCH, sysInfo.curId << 4 | id);
+}
+
+//Change the priority a thread is scheduled at, moving it in the ready
+//bitmap if it is waiting to run.  Interrupts must be disabled.
+void thread_set_priority(uint8_t id, uint8_t priority) {
+   uint8_t old = sysInfo.threads[id].priority;
+
+   if (priority == old)
+      return;
+
+   sysInfo.threads[id].priority = priority;
+
+   if (sysInfo.threads[id].state == THREAD_READY) {
+      sysInfo.ready[old] &= ~(1 << id);
+      if (!sysInfo.ready[old])
+         sysInfo.readyPrio &= ~(1 << old);
+      thread_ready(id);
+   }
+}
+
+//Milliseconds a thread has run for, counting the current time slice
+uint32_t thread_cpu_time(uint8_t id) {
+   uint32_t t, steps;
+   uint8_t sreg = SREG;
+
+   cli();
+   t = sysInfo.threads[id].cpuTime;
+   steps = sysInfo.threads[id].cpuSteps;
+   if (id == sysInfo.curId)
+      steps += os_clock() - sysInfo.switchAt;
+   SREG = sreg;
+
+   return t + steps / CLOCK_PER_TICK;
+}
+
+//Percentage of the last second the idle thread ran
+uint8_t os_idle_percent(void) {
+   uint8_t last = sysInfo.loadNext ? sysInfo.loadNext - 1 : LOAD_SECS - 1;
+
+   return sysInfo.loadCount ? sysInfo.idle[last] : 100;
+}
+
+//Average percentage of time threads other than idle ran over the last
+//seconds, at most LOAD_SECS
+uint8_t os_load(uint8_t seconds) {
+   uint8_t i, n, slot, sreg = SREG;
+   uint16_t idle = 0;
+
+   cli();
+   slot = sysInfo.loadNext;
+   n = seconds < sysInfo.loadCount ? seconds : sysInfo.loadCount;
+   for (i = 0; i < n; i++) {
+      slot = slot ? slot - 1 : LOAD_SECS - 1;
+      idle += sysInfo.idle[slot];
+   }
+   SREG = sreg;
+
+   return n ? 100 - idle / n : 0;
+}
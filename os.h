@@ -5,7 +5,44 @@
 #include <avr/interrupt.h>
 #include <string.h>
 
-#define MAX_THREADS 4
+#define MAX_THREADS 8     //At most 8, ready threads are kept in a bitmap
+#define NO_THREAD 0xFF    //End of a thread list
+
+//Thread priorities, higher runs first
+#define NUM_PRIORITIES 4  //At most 8
+#define PRIORITY_IDLE 0
+#define PRIORITY_LOW 1
+#define PRIORITY_NORMAL 2
+#define PRIORITY_HIGH 3
+
+//System tick rate, the scheduler runs every tick
+#define TICK_HZ 1000
+
+//Run time is measured with the tick timer's count, which steps every
+//CLOCK_CYCLES CPU cycles and wraps CLOCK_PER_TICK steps into each tick
+#define CLOCK_CYCLES 64
+#define CLOCK_PER_TICK (F_CPU / CLOCK_CYCLES / TICK_HZ)
+#define CLOCK_PER_SEC ((uint32_t)CLOCK_PER_TICK * TICK_HZ)
+
+//Seconds of load history kept for os_load()
+#define LOAD_SECS 10
+
+//Thread stacks are carved from a static pool so the linker accounts for
+//them in .bss, override with -DSTACK_POOL_SIZE to fit the application
+#ifndef STACK_POOL_SIZE
+#define STACK_POOL_SIZE 512
+#endif
+
+//Bytes the tick interrupt and the scheduler calls it makes need on top of
+//the saved registers of an interrupted thread
+#define STACK_MARGIN 32
+
+//Fill pattern for unused stack, see thread_stack_peak
+#define STACK_CANARY 0xA5
+
+//Pool bytes used by a thread with the given user stack size
+#define THREAD_STACK(size) ((size) + sizeof(regs_context_switch) + \
+ sizeof(regs_interrupt) + STACK_MARGIN)
 
 //This structure defines the register order pushed to the stack on a
 //system context switch.
@@ -67,7 +104,7 @@ volatile typedef enum {
    THREAD_RUNNING,
    THREAD_READY,
    THREAD_SLEEPING,
-   THREAD_WAITING
+   THREAD_BLOCKED    //On a mutex, semaphore or event, only it readies the thread
 } TState;
 
 volatile typedef struct {
@@ -78,9 +115,14 @@ volatile typedef struct {
    uint16_t userSize;   //User defined stack size
    uint32_t totSize;    //Total number of bytes allocated for stack
    uint16_t pc;         //Starting PC of thread function
+   uint8_t priority;       //Scheduling priority, raised while inheriting
+   uint8_t basePriority;   //Priority the thread was created with
    TState state;           //Thread state
-   uint16_t sleep;         //Sleep ticks
+   uint16_t sleep;         //Sleep ticks after the previous sleeping thread
+   uint8_t next;           //Next thread in the sleep queue
    uint16_t sched_count;   //Number of times per second thread was run
+   uint32_t cpuTime;       //Milliseconds spent running, wraps after 49 days
+   uint8_t cpuSteps;       //Clock steps run toward the next millisecond
    uint8_t intr_pcl;       //Interrupted PC address low byte
    uint8_t intr_pch;       //Interrupted PC address high byte
 } thread_t;
@@ -91,21 +133,57 @@ volatile typedef struct {
    thread_t threads[MAX_THREADS];   //Max 8 threads
    uint8_t numThreads;              //Number of threads
    uint8_t curId;                   //Current running thread id
-   uint32_t numIntr;                //Number of interrupts since OS start
+   uint32_t numIntr;                //Number of ticks since os_init()
+   uint16_t secTicks;               //Ticks into the current second
+   uint8_t ready[NUM_PRIORITIES];   //Bitmap of ready threads per priority
+   uint8_t readyPrio;               //Bitmap of priorities with ready threads
+   uint8_t lastRun[NUM_PRIORITIES]; //Thread picked last per priority
+   uint8_t sleepHead;               //First thread of the sleep queue
+   uint8_t started;                 //Set once os_start() has run
+   uint32_t switchAt;               //Clock at the last context switch
+   uint32_t idleMark;               //Idle thread cpuTime a second ago
+   uint8_t idle[LOAD_SECS];         //Idle percentage of recent seconds
+   uint8_t loadNext;                //Slot of idle to fill next
+   uint8_t loadCount;               //Seconds of history in idle
 } system_t;
 
 //OS functions
 void os_init();
-void create_thread(uint16_t address, void* args, uint16_t stack_size);
+int8_t create_thread(uint16_t address, void* args, uint16_t stack_size,
+ uint8_t priority);
 void os_start(void);
 uint8_t get_next_thread(void);
 void thread_sleep(uint16_t ticks);
+void thread_sleep_until(uint32_t tick);
+uint32_t os_ticks(void);
+void thread_charge(uint8_t id);
+void thread_set_priority(uint8_t id, uint8_t priority);
+uint32_t thread_cpu_time(uint8_t id);
+uint8_t os_idle_percent(void);
+uint8_t os_load(uint8_t seconds);
+uint16_t stack_pool_free(void);
+uint16_t thread_stack_peak(uint8_t id);
 int main();
 
 void start_system_timer();
+void start_sample_timer(uint16_t rate);
 void start_audio_pwm();
 
 //Global variables
 volatile system_t sysInfo;              //OS information
 
+//Mark a thread ready to run, interrupts must be disabled
+static inline void thread_ready(uint8_t id) {
+   uint8_t prio = sysInfo.threads[id].priority;
+
+   sysInfo.threads[id].state = THREAD_READY;
+   sysInfo.ready[prio] |= 1 << id;
+   sysInfo.readyPrio |= 1 << prio;
+}
+
+//Threads are running, so waits can sleep instead of spinning
+static inline uint8_t os_running(void) {
+   return sysInfo.started;
+}
+
 #endif
@@ -7,14 +7,17 @@ void start_system_timer() {
    TIMSK0 |= _BV(OCIE0A);  /* IRQ on compare.  */
    TCCR0A |= _BV(WGM01); //clear timer on compare match
 
-   //11KHz settings
-   TCCR0B |= _BV(CS01) | _BV(CS01); //slowest prescalar /1024
-   OCR0A = 180; 
+   //Generate timer interrupt every millisecond (TICK_HZ)
+   TCCR0B |= _BV(CS01) | _BV(CS00); //prescalar /64
+   OCR0A = CLOCK_PER_TICK - 1;
+}
 
-   //start timer 1 to generate interrupt every 1 second
-   OCR1A = 15625;
+//Start timer 1 to generate an interrupt for every audio sample
+void start_sample_timer(uint16_t rate) {
+   OCR1A = F_CPU / rate - 1;
+   TCNT1 = 0;
    TIMSK1 |= _BV(OCIE1A);  /* IRQ on compare.  */
-   TCCR1B |= _BV(WGM12) | _BV(CS12) | _BV(CS10); //slowest prescalar /1024
+   TCCR1B |= _BV(WGM12) | _BV(CS10); //clear timer on compare match, no prescalar
 }
 
 void start_audio_pwm() {
@@ -0,0 +1,49 @@
+#include <avr/interrupt.h>
+#include "prefetch.h"
+
+void prefetch_init(prefetch_t *p) {
+   p->head = 0;
+   p->tail = 0;
+   p->fill = 0;
+   p->pos = 0;
+   p->starved = 1;   //Nothing has played yet
+   p->woken = 0;
+   p->underruns = 0;
+   p->worst = 0;
+}
+
+//Producer: add up to count bytes, returns the number added
+uint8_t prefetch_write(prefetch_t *p, const uint8_t *src, uint8_t count) {
+   uint8_t i;
+   uint16_t space = prefetch_space(p);
+
+   if (count > space)
+      count = space;
+
+   for (i = 0; i < count; i++) {
+      *prefetch_head(p) = src[i];
+      prefetch_commit(p, 1);
+   }
+
+   return count;
+}
+
+//Producer: the buffer is full again, note how long that took since the
+//consumer asked for more
+void prefetch_filled(prefetch_t *p) {
+   uint8_t sreg = SREG;
+   uint16_t ticks;
+
+   if (!p->woken)
+      return;
+
+   cli();
+   ticks = (uint16_t)sysInfo.numIntr - p->lowAt;
+   p->woken = 0;
+   SREG = sreg;
+
+   if (ticks > p->worst)
+      p->worst = ticks;
+
+   TRACE(TRACE_FULL, ticks > 0xFF ? 0xFF : ticks);
+}
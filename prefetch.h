@@ -0,0 +1,148 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "os.h"
+#include "ring.h"
+#include "bench.h"
+#include "trace.h"
+
+//Read-ahead buffer between the SD reader and the sample interrupt.
+//
+//Audio is kept in PREFETCH_DEPTH slots of PREFETCH_SLOT bytes.  The
+//producer fills the slot at head and hands it over whole, the consumer
+//plays the slot at tail a byte at a time and hands it back when done.
+//Head and tail count slots and run freely, each is moved by one side
+//only, so as with ring_t neither side disables interrupts.
+//
+//The depth trades RAM for tolerance of slow cards and is set per build,
+//e.g. make PREFETCH_DEPTH=8.  It must be a power of two.
+#ifndef PREFETCH_DEPTH
+#define PREFETCH_DEPTH 4
+#endif
+#define PREFETCH_SLOT 64
+
+//The producer is woken when this many full slots are left
+#define PREFETCH_LOW (PREFETCH_DEPTH / 2)
+
+typedef char prefetchDepthCheck[PREFETCH_DEPTH >= 2 &&
+ PREFETCH_DEPTH <= 128 && !(PREFETCH_DEPTH & (PREFETCH_DEPTH - 1)) ? 1 : -1];
+
+typedef struct {
+   uint8_t slot[PREFETCH_DEPTH][PREFETCH_SLOT];
+   volatile uint8_t head;        //Slots filled
+   volatile uint8_t tail;        //Slots played
+   uint8_t fill;                 //Producer: bytes in the slot at head
+   uint8_t pos;                  //Consumer: bytes played from the slot at tail
+   uint8_t starved;              //Consumer: ran dry and has not resumed
+   volatile uint8_t woken;       //The producer was asked for more
+   volatile uint16_t lowAt;      //Tick it was asked at
+   volatile uint16_t underruns;  //Times the consumer ran dry
+   uint16_t worst;               //Longest ticks from asking to full
+} prefetch_t;
+
+void prefetch_init(prefetch_t *p);
+uint8_t prefetch_write(prefetch_t *p, const uint8_t *src, uint8_t count);
+void prefetch_filled(prefetch_t *p);
+
+//Number of full slots
+static inline uint8_t prefetch_depth(prefetch_t *p) {
+   return p->head - p->tail;
+}
+
+//Producer: bytes that can be added
+static inline uint16_t prefetch_space(prefetch_t *p) {
+   return (PREFETCH_DEPTH - prefetch_depth(p)) * PREFETCH_SLOT - p->fill;
+}
+
+//Producer: bytes waiting to be played, with the consumer's place in the
+//slot it is playing read under masked interrupts
+static inline uint16_t prefetch_queued(prefetch_t *p) {
+   uint8_t sreg = SREG;
+   uint16_t count;
+
+   cli();
+   count = prefetch_depth(p) * PREFETCH_SLOT - p->pos;
+   SREG = sreg;
+
+   return count + p->fill;
+}
+
+//Times the consumer ran dry, read with interrupts masked as the count
+//is two bytes the sample interrupt changes
+static inline uint16_t prefetch_underruns(prefetch_t *p) {
+   uint8_t sreg = SREG;
+   uint16_t count;
+
+   cli();
+   count = p->underruns;
+   SREG = sreg;
+
+   return count;
+}
+
+//Longest refill in ticks, read with interrupts masked as the count is
+//two bytes the reader thread can change when it preempts the caller
+static inline uint16_t prefetch_worst(prefetch_t *p) {
+   uint8_t sreg = SREG;
+   uint16_t ticks;
+
+   cli();
+   ticks = p->worst;
+   SREG = sreg;
+
+   return ticks;
+}
+
+//Producer: fill the slot in place from prefetch_head(), up to the end of
+//the slot, then publish the bytes with prefetch_commit()
+static inline uint8_t *prefetch_head(prefetch_t *p) {
+   return p->slot[p->head & (PREFETCH_DEPTH - 1)] + p->fill;
+}
+
+static inline void prefetch_commit(prefetch_t *p, uint8_t count) {
+   if ((p->fill += count) == PREFETCH_SLOT) {
+      p->fill = 0;
+      ring_barrier();
+      p->head++;
+   }
+}
+
+//Consumer: next byte, returns 0 with nothing to play.  Interrupt only,
+//the tick counter is read without masking the tick interrupt.
+static inline uint8_t prefetch_get(prefetch_t *p, uint8_t *b) {
+   if (!prefetch_depth(p)) {
+      if (!p->starved) {
+         p->starved = 1;
+         p->underruns++;
+         bench_mark(BENCH_UNDERRUN);
+         TRACE(TRACE_UNDERRUN, 0);
+      }
+      return 0;
+   }
+
+   p->starved = 0;
+   *b = p->slot[p->tail & (PREFETCH_DEPTH - 1)][p->pos];
+
+   if (++p->pos == PREFETCH_SLOT) {
+      p->pos = 0;
+      ring_barrier();
+      p->tail++;
+
+      if (prefetch_depth(p) == PREFETCH_LOW) {
+         p->lowAt = sysInfo.numIntr;
+         p->woken = 1;
+         TRACE(TRACE_LOW, PREFETCH_LOW);
+      }
+   }
+
+   return 1;
+}
+
+//Consumer: a slot was just handed back leaving the low watermark
+static inline uint8_t prefetch_at_low(prefetch_t *p) {
+   return !p->pos && prefetch_depth(p) == PREFETCH_LOW;
+}
+
+#endif
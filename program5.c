@@ -7,48 +7,257 @@
 #include "ext2.h"
 #include "SdReader.h"
 #include "synchro.h"
-
-uint8_t buffers[2][256];
-mutex_t mutexes[2];
+#include "prefetch.h"
+#include "wav.h"
+#include "screen.h"
+#include "bench.h"
+#include "trace.h"
+
+//The reader reads the track in CHUNK_LEN pieces, CHUNK_LEN divides
+//PREFETCH_SLOT so a chunk read in place is never split by a slot
+#define CHUNK_LEN 32
+
+//Status screen refresh rate
+#define REFRESH_HZ 10
+
+//Output volume, samples are scaled by volume / VOLUME_MAX
+#define VOLUME_MAX 8
+#define VOLUME_SHIFT 3
+
+//Player state is kept in the second half of the boot block, which ext2
+//never uses, and saved every STATE_SAVE_SEC while playing
+#define STATE_SECTOR 1
+#define STATE_MAGIC 0x59414C50   //"PLAY"
+#define STATE_SAVE_SEC 60
+
+struct player_state {
+   uint32_t magic;
+   uint32_t inode;      //Track, found again by inode and name hash
+   uint16_t hash;
+   uint32_t position;   //Bytes into the track data
+   uint8_t volume;
+};
+
+//Thread stack sizes, the build fails if they do not fit in the stack pool
+#define READER_STACK 256
+#define PRINTER_STACK 80
+typedef char stackPoolCheck[THREAD_STACK(READER_STACK) +
+ THREAD_STACK(PRINTER_STACK) <= STACK_POOL_SIZE ? 1 : -1];
+
+prefetch_t audio;
+event_t refill;
+mutex_t fileMutex;
+
+//Trace log on the card, dumps are written one after another until it is
+//full, from the start again after a reset
+uint32_t logSector;
+uint16_t logSectors, logNext;
 
 uint8_t numFiles, currentFile;
+struct wav_format format;
+volatile uint8_t volume = VOLUME_MAX;
 
-void writer() {
-   uint8_t buffer = 0, pos = 0;
+//Sample clock, plays the next sample from the read-ahead buffer
+//The tick interrupt does not interrupt this routine
+ISR(TIMER1_COMPA_vect) {
+   uint8_t sample;
 
-   while (1) {
-      if (! pos) {
-         mutex_unlock(&mutexes[buffer]);
-         buffer ^= 1;
-         mutex_lock(&mutexes[buffer]);
-      }
+   bench_begin(BENCH_SAMPLE);
+
+   //Underrun, hold the last sample
+   if (!prefetch_get(&audio, &sample)) {
+      bench_end(BENCH_SAMPLE);
+      return;
+   }
+
+   OCR2B = 128 + (((int16_t)sample - 128) * volume >> VOLUME_SHIFT);
+
+   if (prefetch_at_low(&audio))
+      event_set_isr(&refill);
+
+   bench_end(BENCH_SAMPLE);
+}
+
+//Open a track and switch the sample clock to its rate
+void openTrack(uint8_t ndx) {
+   wavOpen(ndx, &format);
+   start_sample_timer(format.sampleRate);
+}
+
+//Bytes into the track data of the sample playing now, the reader is
+//ahead by what waits in the read-ahead buffer.  Audio still queued from
+//the track before counts as the start of this one.
+uint32_t playPosition() {
+   uint32_t pos = getCurrentPos();
+   uint32_t queued = (uint32_t)prefetch_queued(&audio) * format.frameSize;
+
+   return pos > queued ? pos - queued : 0;
+}
+
+//Save the track, position and volume.  fileMutex is only held to send
+//the block, the card is polled without it while it programs the block.
+void saveState() {
+   struct player_state state;
+   uint8_t busy;
 
-      OCR2B = buffers[buffer][pos];
-      pos++;
+   mutex_lock(&fileMutex);
 
+   state.magic = STATE_MAGIC;
+   state.inode = getTrack(currentFile)->inode;
+   state.hash = getTrack(currentFile)->hash;
+   state.position = playPosition();
+   state.volume = volume;
+   busy = sdWriteSend(STATE_SECTOR, (uint8_t *)&state, sizeof(state));
+
+   mutex_unlock(&fileMutex);
+
+   while (busy) {
       thread_sleep(1);
+
+      mutex_lock(&fileMutex);
+      busy = !sdWriteDone();
+      mutex_unlock(&fileMutex);
    }
 }
 
+//Restore the saved volume and pick the saved track, returns the position
+//to resume the track at
+uint32_t loadState() {
+   struct player_state state;
+   uint8_t i;
+
+   currentFile = 0;
+   if (!sdReadData(STATE_SECTOR, 0, (uint8_t *)&state, sizeof(state)) ||
+    state.magic != STATE_MAGIC)
+      return 0;
+
+   volume = state.volume <= VOLUME_MAX ? state.volume : VOLUME_MAX;
+   for (i = 0; i < numFiles; i++) {
+      if (getTrack(i)->inode == state.inode &&
+       getTrack(i)->hash == state.hash) {
+         currentFile = i;
+         return state.position;
+      }
+   }
+
+   return 0;
+}
+
 void reader() {
-   uint8_t buffer = 0;
+   uint8_t raw[CHUNK_LEN], n;
 
    while (1) {
-      buffer ^= 1;
+      mutex_lock(&fileMutex);
+
+      //Read ahead until every slot is full
+      while (prefetch_space(&audio) >= CHUNK_LEN) {
+         if (format.frameSize == 1 && !(audio.fill % CHUNK_LEN)) {
+            //Already 8 bit mono, read straight into the slot
+            getFileChunk(prefetch_head(&audio), CHUNK_LEN);
+            prefetch_commit(&audio, CHUNK_LEN);
+         } else {
+            getFileChunk(raw, CHUNK_LEN);
+            n = wavConvert(raw, CHUNK_LEN, &format);
+            prefetch_write(&audio, raw, n);
+         }
+      }
 
-      mutex_lock(&mutexes[buffer]);
+      mutex_unlock(&fileMutex);
+      prefetch_filled(&audio);
 
-      getFileChunk(buffers[buffer]);
+      //Wait for the sample interrupt to play it down to the low watermark
+      event_wait(&refill);
+   }
+}
 
-      mutex_unlock(&mutexes[buffer]);
+//Status screen fields that change while playing
+static field_t runtimeField, intrField, dropField, fileField, posField;
+static field_t idleField, load1Field, load10Field, lockField;
+static field_t totalField, volumeField;
+static field_t depthField, underrunField, refillField;
+static field_t peakField[MAX_THREADS], cpuField[MAX_THREADS];
+
+//Draw the labels and the values that never change, then mark every
+//field dirty so the next update fills them in
+static void draw_screen(void) {
+   uint8_t i, col;
+
+   screen_clear();
+
+   screen_text(1, 1, YELLOW, "System time (s): ");
+   field_init(&runtimeField, 1, 18, 10, FIELD_DEC, YELLOW);
+   screen_text(2, 1, YELLOW, "Interrupts/second: ");
+   field_init(&intrField, 2, 20, 10, FIELD_DEC, YELLOW);
+   screen_text(3, 1, YELLOW, "Number of Threads: ");
+   screen_value(3, 20, YELLOW, FIELD_DEC, sysInfo.numThreads);
+   screen_text(4, 1, YELLOW, "Serial drops: ");
+   field_init(&dropField, 4, 15, 5, FIELD_DEC, YELLOW);
+   screen_text(1, 32, YELLOW, "Idle (%): ");
+   field_init(&idleField, 1, 42, 3, FIELD_DEC, YELLOW);
+   screen_text(2, 32, YELLOW, "Load 1 s (%): ");
+   field_init(&load1Field, 2, 46, 3, FIELD_DEC, YELLOW);
+   screen_text(3, 32, YELLOW, "Load 10 s (%): ");
+   field_init(&load10Field, 3, 47, 3, FIELD_DEC, YELLOW);
+   screen_text(4, 32, YELLOW, "File lock waits: ");
+   field_init(&lockField, 4, 49, 5, FIELD_DEC, YELLOW);
+
+   for (i = 0; i < sysInfo.numThreads; i++) {
+      col = i * 25 + 1;
+      screen_text(5, col, GREEN, "Thread id:    ");
+      screen_value(5, col + 14, GREEN, FIELD_DEC, sysInfo.threads[i].id);
+      screen_text(6, col, GREEN, "Thread PC:    ");
+      screen_value(6, col + 14, GREEN, FIELD_HEX, sysInfo.threads[i].pc * 2);
+      screen_text(7, col, GREEN, "Stack peak:   ");
+      field_init(&peakField[i], 7, col + 14, 5, FIELD_DEC, GREEN);
+      screen_text(8, col, GREEN, "Stack size:   ");
+      screen_value(8, col + 14, GREEN, FIELD_DEC, sysInfo.threads[i].totSize);
+      screen_text(9, col, GREEN, "CPU (ms):     ");
+      field_init(&cpuField[i], 9, col + 14, 10, FIELD_DEC, GREEN);
    }
+
+   screen_text(11, 1, GREEN, "File: ");
+   field_init(&fileField, 11, 7, 3, FIELD_DEC, GREEN);
+   screen_text(11, 10, GREEN, "/ ");
+   screen_value(11, 12, GREEN, FIELD_DEC, numFiles);
+   if (getSkippedTracks() || getSkippedDirs()) {
+      screen_text(11, 17, RED, "Not listed: ");
+      screen_value(11, 29, RED, FIELD_DEC, getSkippedTracks());
+      screen_text(11, 33, RED, "files ");
+      screen_value(11, 39, RED, FIELD_DEC, getSkippedDirs());
+      screen_text(11, 43, RED, "dirs");
+   }
+   field_init(&posField, 13, 1, 6, FIELD_TIME, GREEN);
+   screen_text(13, 8, GREEN, "/ ");
+   field_init(&totalField, 13, 10, 6, FIELD_TIME, GREEN);
+   screen_text(13, 20, GREEN, "Volume: ");
+   field_init(&volumeField, 13, 28, 2, FIELD_DEC, GREEN);
+
+   screen_text(15, 1, GREEN, "Buffered: ");
+   field_init(&depthField, 15, 11, 3, FIELD_DEC, GREEN);
+   screen_text(15, 15, GREEN, "/ ");
+   screen_value(15, 17, GREEN, FIELD_DEC, PREFETCH_DEPTH);
+   screen_text(15, 21, GREEN, "Underruns: ");
+   field_init(&underrunField, 15, 32, 5, FIELD_DEC, GREEN);
+   screen_text(15, 38, GREEN, "Worst refill (ms): ");
+   field_init(&refillField, 15, 57, 5, FIELD_DEC, GREEN);
+}
+
+//Draw the name and length of the track just opened
+static void draw_track(void) {
+   char *name = getCurrentName();
+
+   screen_text(12, 1, GREEN, name);
+   screen_pad(NAME_LEN - strlen(name));
+   field_update(&totalField, getCurrentSize() / format.byteRate);
 }
 
 void printer() {
    uint8_t input, i;
-   uint16_t curr, total;
+   uint32_t next, savedAt = 0;
 
-   total = getCurrentSize() / SAMPLE_RATE;
+   draw_screen();
+   draw_track();
+   next = os_ticks();
 
    while (1) {
       if (byte_available()) {
@@ -61,132 +270,120 @@ void printer() {
          } else if (input == 'p') {
             currentFile = currentFile ? currentFile - 1 : numFiles - 1;
             i = 1;
+         } else if (input == '+' && volume < VOLUME_MAX) {
+            volume++;
+            i = 2;
+         } else if (input == '-' && volume) {
+            volume--;
+            i = 2;
+         } else if (input == 't') {
+            //The dump is binary, draw the screen again after it
+            trace_dump();
+            draw_screen();
+            draw_track();
          }
 
-         if (i) {
-            mutex_lock(&mutexes[0]);
-            mutex_lock(&mutexes[1]);
-
-            clear_screen();
+         if (i == 1) {
+            mutex_lock(&fileMutex);
 
-            getFile(currentFile);
+            openTrack(currentFile);
 
-            mutex_unlock(&mutexes[0]);
-            mutex_unlock(&mutexes[1]);
+            mutex_unlock(&fileMutex);
 
-            total = getCurrentSize() / SAMPLE_RATE;
+            draw_track();
          }
-      }
 
-      set_color(YELLOW);
+         //Remember the choice right away
+         if (i)
+            savedAt = sysInfo.runtime - STATE_SAVE_SEC;
+      }
 
-      set_cursor(1, 0);
-      print_string("System time (s): ");
-      print_int32(sysInfo.runtime);
-      set_cursor(2, 0);
-      print_string("Interrupts/second: ");
-      print_int32(sysInfo.numIntr / sysInfo.runtime);
-      print_string("     ");
-      set_cursor(3, 0);
-      print_string("Number of Threads: ");
-      print_int(sysInfo.numThreads);
+      //The card cannot be read while it programs a block, so the save
+      //waits for a full read-ahead buffer to play from meanwhile
+      if (sysInfo.runtime - savedAt >= STATE_SAVE_SEC &&
+       prefetch_space(&audio) < CHUNK_LEN) {
+         saveState();
+         savedAt = sysInfo.runtime;
+      }
 
-      set_color(GREEN);
+      //Keep the trace of an underrun on the card, also only with the
+      //buffer full.  The multiple block write holds the card throughout.
+      if (trace_frozen() && logNext + TRACE_BLOCKS <= logSectors &&
+       prefetch_space(&audio) < CHUNK_LEN) {
+         mutex_lock(&fileMutex);
+         trace_save(logSector + logNext);
+         mutex_unlock(&fileMutex);
+         logNext += TRACE_BLOCKS;
+      }
 
+      //Only fields whose value changed are sent
+      field_update(&runtimeField, sysInfo.runtime);
+      field_update(&intrField, sysInfo.runtime ?
+       sysInfo.numIntr / sysInfo.runtime : sysInfo.numIntr);
+      field_update(&dropField, serial_tx_dropped());
+      field_update(&idleField, os_idle_percent());
+      field_update(&load1Field, os_load(1));
+      field_update(&load10Field, os_load(LOAD_SECS));
+      field_update(&lockField, fileMutex.contention);
       for (i = 0; i < sysInfo.numThreads; i++) {
-         set_cursor(5, i * 25);
-         print_string("Thread id:    ");
-         print_int(sysInfo.threads[i].id);
-         set_cursor(6, i * 25);
-         print_string("Thread PC:    ");
-         print_hex(sysInfo.threads[i].pc * 2);
-         set_cursor(7, i * 25);
-         print_string("Stack usage:  ");
-         if (i == 0)
-            print_int(
-             (uint16_t)sysInfo.threads[i].stackBase - sysInfo.threads[i].tp);
-         else
-            print_int(
-             (uint16_t)sysInfo.threads[i].stackEnd - sysInfo.threads[i].tp);
-         set_cursor(8, i * 25);
-         print_string("Stack size:   ");
-         print_int(sysInfo.threads[i].totSize);
-         // set_cursor(9, i * 25);
-         // print_string("Top of stack: ");
-         // print_hex(sysInfo.threads[i].tp);
-         // set_cursor(10, i * 25);
-         // print_string("Stack base:   ");
-         // print_hex(sysInfo.threads[i].stackBase);
-         // set_cursor(11, i * 25);
-         // print_string("Stack end:    ");
-         // print_hex(sysInfo.threads[i].stackEnd);
-         // set_cursor(12, i * 25);
-         // print_string("Sched count:  ");
-         // print_int(sysInfo.threads[i].sched_count / sysInfo.runtime);
-         // set_cursor(13, i * 25);
-         // print_string("PC interrupt: ");
-         // print_hex(((uint16_t)sysInfo.threads[i].intr_pcl
-         //  + ((uint16_t)sysInfo.threads[i].intr_pch << 8)) * 2);
+         field_update(&peakField[i], thread_stack_peak(i));
+         field_update(&cpuField[i], thread_cpu_time(i));
       }
-
-      set_cursor(11,0);
-      print_string("File: ");
-      print_int(currentFile + 1);
-      print_string(" / ");
-      print_int(numFiles);
-      print_string("  ");
-
-      set_cursor(12, 0);
-      for (i = 0; i < NAME_LEN; i++)
-         print_string(" ");
-
-      set_cursor(12, 0);
-      print_string(getCurrentName());
-
-      curr = getCurrentPos() / SAMPLE_RATE;
-
-      set_cursor(13, 0);
-      print_int(curr / 60);
-      print_string(":");
-      if (curr % 60 < 10)
-         print_int(0);
-      print_int(curr % 60);
-
-      print_string(" / ");
-
-      print_int(total / 60);
-      print_string(":");
-      if (total % 60 < 10)
-         print_int(0);
-      print_int(total % 60);
-
-      print_string("  ");
+      field_update(&fileField, currentFile + 1);
+      field_update(&posField, playPosition() / format.byteRate);
+      field_update(&volumeField, volume);
+      field_update(&depthField, prefetch_depth(&audio));
+      field_update(&underrunField, prefetch_underruns(&audio));
+      field_update(&refillField, prefetch_worst(&audio));
+
+      next += TICK_HZ / REFRESH_HZ;
+      thread_sleep_until(next);
    }
 }
 
 int main(void) {
    uint8_t sd_card_status;
+   uint32_t position;
+
+   bench_init();
+
+   //The tick runs from here so the SD card waits can time out
+   os_init();
+   mutex_init(&fileMutex);
+   event_init(&refill);
+   prefetch_init(&audio);
+   sei();
 
    sd_card_status = sdInit(0);   //initialize the card with fast clock
                                  //if this does not work, try sdInit(1)
                                  //for a slower clock
    serial_init();
-   ext2_init();
+   if (!ext2_init()) {
+      print_string("No ext2 filesystem on the card");
+      while (1) ;
+   }
 
-   numFiles = getNumFiles();
-   currentFile = 0;
-   getFile(currentFile);
+   //The track index saves scanning every directory when it is current
+   numFiles = loadTrackIndex();
+   if (!numFiles)
+      numFiles = getNumFiles();
 
-   start_audio_pwm();
-   os_init();
+   //Before a track is open, looking the file up changes the current inode
+   logSector = getFileRun(TRACE_LOG_PATH, &logSectors);
 
-   mutex_init(&mutexes[0]);
-   mutex_init(&mutexes[1]);
+   //Carry on where playback was last saved
+   position = loadState();
+   openTrack(currentFile);
+   setFilePos(position);
+
+   start_audio_pwm();
 
    //Create threads
-   create_thread(writer, NULL, 32);
-   create_thread(reader, NULL, 256);
-   create_thread(printer, NULL, 64);
+   if (create_thread(reader, NULL, READER_STACK, PRIORITY_HIGH) < 0 ||
+    create_thread(printer, NULL, PRINTER_STACK, PRIORITY_LOW) < 0) {
+      print_string("Out of thread stack space");
+      while (1) ;
+   }
    os_start();
    sei();
 
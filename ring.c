@@ -0,0 +1,38 @@
+#include "ring.h"
+
+void ring_init(ring_t *r, uint8_t *buf, uint16_t size, uint8_t low,
+ uint8_t high) {
+
+   r->buf = buf;
+   r->mask = size - 1;
+   r->head = 0;
+   r->tail = 0;
+   r->low = low;
+   r->high = high;
+}
+
+//Producer: add up to count bytes, returns the number added
+uint8_t ring_write(ring_t *r, const uint8_t *src, uint8_t count) {
+   uint8_t i, space = ring_space(r);
+
+   if (count > space)
+      count = space;
+
+   for (i = 0; i < count; i++)
+      ring_put(r, src[i]);
+
+   return count;
+}
+
+//Consumer: remove up to count bytes, returns the number removed
+uint8_t ring_read(ring_t *r, uint8_t *dst, uint8_t count) {
+   uint8_t i, queued = ring_count(r);
+
+   if (count > queued)
+      count = queued;
+
+   for (i = 0; i < count; i++)
+      dst[i] = ring_get(r);
+
+   return count;
+}
@@ -0,0 +1,79 @@
+#ifndef RING_H
+#define RING_H
+
+#include <avr/io.h>
+
+//Single producer, single consumer byte ring buffer.
+//
+//The producer only moves head and the consumer only moves tail, both are
+//8 bit so they are read and written atomically and neither side needs to
+//disable interrupts. One side may be an interrupt routine. The size is a
+//power of two up to 256, one slot is kept empty to tell full from empty.
+typedef struct {
+   uint8_t *buf;           //Storage
+   uint8_t mask;           //Size - 1
+   volatile uint8_t head;  //Next slot to write
+   volatile uint8_t tail;  //Next slot to read
+   uint8_t low;            //Consumer wakes the producer at this count
+   uint8_t high;           //Producer fills up to this count
+} ring_t;
+
+//Keep the compiler from moving buffer accesses past index updates
+#define ring_barrier() asm volatile ("" : : : "memory")
+
+void ring_init(ring_t *r, uint8_t *buf, uint16_t size, uint8_t low,
+ uint8_t high);
+uint8_t ring_write(ring_t *r, const uint8_t *src, uint8_t count);
+uint8_t ring_read(ring_t *r, uint8_t *dst, uint8_t count);
+
+//Number of bytes queued
+static inline uint8_t ring_count(ring_t *r) {
+   return (r->head - r->tail) & r->mask;
+}
+
+//Number of bytes that can be added
+static inline uint8_t ring_space(ring_t *r) {
+   return r->mask - ring_count(r);
+}
+
+//Count just dropped to the low watermark, checked after ring_get
+static inline uint8_t ring_at_low(ring_t *r) {
+   return ring_count(r) == r->low;
+}
+
+//Count is at or above the high watermark
+static inline uint8_t ring_above_high(ring_t *r) {
+   return ring_count(r) >= r->high;
+}
+
+//Producer: add a byte, the ring must not be full
+static inline void ring_put(ring_t *r, uint8_t b) {
+   uint8_t head = r->head;
+
+   r->buf[head] = b;
+   ring_barrier();
+   r->head = (head + 1) & r->mask;
+}
+
+//Consumer: remove a byte, the ring must not be empty
+static inline uint8_t ring_get(ring_t *r) {
+   uint8_t tail = r->tail;
+   uint8_t b = r->buf[tail];
+
+   ring_barrier();
+   r->tail = (tail + 1) & r->mask;
+   return b;
+}
+
+//Producer: fill the ring in place, write up to the end of the storage at
+//ring_head() then publish the bytes with ring_commit()
+static inline uint8_t *ring_head(ring_t *r) {
+   return r->buf + r->head;
+}
+
+static inline void ring_commit(ring_t *r, uint8_t count) {
+   ring_barrier();
+   r->head = (r->head + count) & r->mask;
+}
+
+#endif
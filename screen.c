@@ -0,0 +1,104 @@
+#include "globals.h"
+#include "os.h"
+#include "screen.h"
+
+//Most bytes of escape codes written before a field or text
+#define ESC_LEN 14
+
+static uint8_t curColor;   //Color the terminal is set to, 0 if unknown
+
+//Sleep until the serial transmit ring has room for count bytes, so a
+//redraw never outruns the port and drops characters
+void screen_wait(uint8_t count) {
+   while (serial_tx_space() < count)
+      thread_sleep(1);
+}
+
+static void screen_color(uint8_t color) {
+   if (color != curColor) {
+      set_color(color);
+      curColor = color;
+   }
+}
+
+void screen_clear(void) {
+   screen_wait(ESC_LEN);
+   clear_screen();
+   curColor = 0;
+}
+
+//Draw fixed text, used for labels that never change
+void screen_text(uint8_t row, uint8_t col, uint8_t color, char *s) {
+   char *end = s;
+
+   while (*end)
+      end++;
+
+   screen_wait(end - s + ESC_LEN);
+   set_cursor(row, col);
+   screen_color(color);
+   print_string(s);
+}
+
+//Write count spaces at the cursor
+void screen_pad(uint8_t count) {
+   screen_wait(count);
+   while (count--)
+      write_byte(' ');
+}
+
+//Draw a value that never changes
+void screen_value(uint8_t row, uint8_t col, uint8_t color, uint8_t fmt,
+ uint32_t value) {
+   field_t f;
+
+   field_init(&f, row, col, 0, fmt, color);
+   field_update(&f, value);
+}
+
+void field_init(field_t *f, uint8_t row, uint8_t col, uint8_t width,
+ uint8_t fmt, uint8_t color) {
+   f->value = 0;
+   f->row = row;
+   f->col = col;
+   f->width = width;
+   f->fmt = fmt | FIELD_DIRTY;
+   f->color = color;
+}
+
+//Draw the value if it differs from what is on the screen
+void field_update(field_t *f, uint32_t value) {
+   char data[12];
+   uint8_t pos = sizeof(data) - 1, base, tmp;
+
+   if (!(f->fmt & FIELD_DIRTY) && value == f->value)
+      return;
+
+   f->value = value;
+   f->fmt &= ~FIELD_DIRTY;
+   base = (f->fmt == FIELD_HEX) ? 16 : 10;
+
+   data[pos] = 0;
+   if (f->fmt == FIELD_TIME) {
+      //Seconds, then the minutes go through the decimal loop below
+      data[--pos] = '0' + value % 10;
+      data[--pos] = '0' + value / 10 % 6;
+      data[--pos] = ':';
+      value /= 60;
+   }
+
+   do {
+      tmp = value % base;
+      data[--pos] = (tmp < 10) ? ('0' + tmp) : ('A' + tmp - 10);
+      value /= base;
+   } while (value);
+
+   tmp = sizeof(data) - 1 - pos;
+   screen_wait((tmp > f->width ? tmp : f->width) + ESC_LEN);
+   set_cursor(f->row, f->col);
+   screen_color(f->color);
+   print_string(data + pos);
+
+   while (tmp++ < f->width)
+      write_byte(' ');
+}
@@ -0,0 +1,38 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <avr/io.h>
+
+//Field formats
+#define FIELD_DEC 0     //Unsigned decimal
+#define FIELD_HEX 1     //Unsigned hex
+#define FIELD_TIME 2    //Seconds drawn as m:ss
+#define FIELD_DIRTY 0x80   //Redraw on the next update even if unchanged
+
+//A value on the status screen, only drawn again when it changes
+typedef struct {
+   uint32_t value;   //Value currently on the screen
+   uint8_t row;
+   uint8_t col;
+   uint8_t width;    //Characters the value may take, the rest is cleared
+   uint8_t fmt;      //Format and dirty flag
+   uint8_t color;    //ANSI color
+} field_t;
+
+void screen_wait(uint8_t count);
+void screen_clear(void);
+void screen_text(uint8_t row, uint8_t col, uint8_t color, char *s);
+void screen_pad(uint8_t count);
+void screen_value(uint8_t row, uint8_t col, uint8_t color, uint8_t fmt,
+ uint32_t value);
+
+void field_init(field_t *f, uint8_t row, uint8_t col, uint8_t width,
+ uint8_t fmt, uint8_t color);
+void field_update(field_t *f, uint32_t value);
+
+//Force the field to be drawn on its next update
+static inline void field_dirty(field_t *f) {
+   f->fmt |= FIELD_DIRTY;
+}
+
+#endif
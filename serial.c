@@ -1,8 +1,17 @@
+#include <avr/interrupt.h>
 #include "globals.h"
+#include "ring.h"
 
 #define LEN_16 6
 #define LEN_32 11
 
+//Transmit ring, drained by the data register empty interrupt
+#define TX_LEN 128
+
+static uint8_t txBuf[TX_LEN];
+static ring_t tx;
+static volatile uint16_t txDropped;   //Bytes lost to a full ring
+
 /*
  * Initialize the serial port.
  */
@@ -16,10 +25,23 @@ void serial_init() {
    UBRR0H = baud_setting >> 8;
    UBRR0L = baud_setting;
 
+   ring_init(&tx, txBuf, TX_LEN, 0, 0);
+   txDropped = 0;
+
    // enable transmit and receive
    UCSR0B |= (1 << TXEN0) | (1 << RXEN0);
 }
 
+/*
+ * Send the next queued byte, stop the interrupt once the ring is empty.
+ */
+ISR(USART_UDRE_vect) {
+   if (ring_count(&tx))
+      UDR0 = ring_get(&tx);
+   else
+      UCSR0B &= ~(1 << UDRIE0);
+}
+
 /*
  * Return 1 if a character is available else return 0.
  */
@@ -37,19 +59,52 @@ uint8_t read_byte() {
 }
 
 /*
- * Unbuffered write
+ * Buffered write, never blocks once interrupts are enabled
+ * Return 0 if the transmit ring is full and the byte was dropped.
  *
  * b byte to write.
  */
 uint8_t write_byte(uint8_t b) {
-   //loop until the send buffer is empty
-   while (((1 << UDRIE0) & UCSR0B) || !(UCSR0A & (1 << UDRE0))) {}
+   //Nothing drains the ring with interrupts off, write out directly
+   if (!(SREG & (1 << SREG_I))) {
+      while (ring_count(&tx) || !(UCSR0A & (1 << UDRE0))) {
+         if (ring_count(&tx) && (UCSR0A & (1 << UDRE0)))
+            UDR0 = ring_get(&tx);
+      }
+      UDR0 = b;
+      return 1;
+   }
+
+   if (!ring_space(&tx)) {
+      txDropped++;
+      return 0;
+   }
 
-   //write out the byte
-   UDR0 = b;
+   ring_put(&tx, b);
+   UCSR0B |= (1 << UDRIE0);
    return 1;
 }
 
+/*
+ * Return the number of bytes that can be written without dropping any.
+ */
+uint8_t serial_tx_space() {
+   return ring_space(&tx);
+}
+
+/*
+ * Return the number of bytes dropped because the transmit ring was full.
+ */
+uint16_t serial_tx_dropped() {
+   uint16_t dropped;
+   uint8_t sreg = SREG;
+
+   cli();
+   dropped = txDropped;
+   SREG = sreg;
+   return dropped;
+}
+
 /*
  * Write string
  *
@@ -1,5 +1,6 @@
 #include "synchro.h"
 #include "globals.h"
+#include "trace.h"
 
 void sem_enqueue(semaphore_t *s, uint8_t id) {
 
@@ -58,6 +59,86 @@ uint8_t mutex_dequeue(mutex_t *m) {
 }
 
 
+//Put the running thread back on the ready bitmap and switch to the most
+//urgent ready thread.  Interrupts must be disabled.
+static void preempt(void) {
+   uint8_t oldId = sysInfo.curId;
+   regs_context_switch *intr;
+
+   intr = (regs_context_switch *)(sysInfo.threads[oldId].tp);
+   sysInfo.threads[oldId].intr_pcl = intr->pcl;
+   sysInfo.threads[oldId].intr_pch = intr->pch;
+   thread_ready(oldId);
+
+   sysInfo.curId = get_next_thread();
+   sysInfo.threads[sysInfo.curId].state = THREAD_RUNNING;
+   sysInfo.threads[sysInfo.curId].sched_count++;
+   thread_charge(oldId);
+   context_switch(&sysInfo.threads[sysInfo.curId].tp,
+    &sysInfo.threads[oldId].tp);
+}
+
+//Every initialized mutex, to find the ones a thread owns
+static mutex_t *mutexList;
+
+//The mutex a thread is queued on, or 0 if it is not waiting for one
+static mutex_t *mutex_waited_on(uint8_t id) {
+   int i;
+   mutex_t *m;
+
+   for (m = mutexList; m; m = m->next) {
+      if (m->front == -1)
+         continue;
+
+      for (i = m->front; ; i = (i + 1) % MAX_THREADS) {
+         if (m->list[i] == id)
+            return m;
+         if (i == m->end)
+            break;
+      }
+   }
+   return 0;
+}
+
+//Set a thread's priority to its own, or to that of the most urgent
+//thread waiting on a mutex it owns if that is higher.  If the thread is
+//itself waiting on a mutex, the owner of that one is redone as well, and
+//so on down the chain, so nested locks cannot bring the inversion back.
+//A chain never holds more than MAX_THREADS threads unless it deadlocks.
+//Interrupts must be disabled.
+static void mutex_inherit(uint8_t id) {
+   uint8_t prio, waiter, depth;
+   int i;
+   mutex_t *m;
+
+   for (depth = 0; depth < MAX_THREADS; depth++) {
+      prio = sysInfo.threads[id].basePriority;
+
+      for (m = mutexList; m; m = m->next) {
+         if (m->owner != id || m->front == -1)
+            continue;
+
+         for (i = m->front; ; i = (i + 1) % MAX_THREADS) {
+            waiter = m->list[i];
+            if (sysInfo.threads[waiter].priority > prio)
+               prio = sysInfo.threads[waiter].priority;
+            if (i == m->end)
+               break;
+         }
+      }
+
+      if (sysInfo.threads[id].priority == prio)
+         break;
+      thread_set_priority(id, prio);
+
+      m = mutex_waited_on(id);
+      if (!m || m->owner == -1)
+         break;
+      id = m->owner;
+   }
+}
+
+//Call once per mutex
 void mutex_init(mutex_t *m) {
 
    m->owner = -1;
@@ -65,8 +146,16 @@ void mutex_init(mutex_t *m) {
    m->count = 0;
    m->front = -1;
    m->end = -1;
+   m->contention = 0;
+
+   cli();
+   m->next = mutexList;
+   mutexList = m;
+   sei();
 }
 
+//Returns owning the mutex.  A thread that has to wait stays blocked until
+//mutex_unlock hands the mutex to it, so it never needs to check again.
 void mutex_lock(mutex_t *m) {
    cli();
 
@@ -74,8 +163,14 @@ void mutex_lock(mutex_t *m) {
       m->owner = sysInfo.curId;
    }
    else if (m->owner != sysInfo.curId) {
+      TRACE(TRACE_MUTEX_WAIT, m->owner << 4 | sysInfo.curId);
       mutex_enqueue(m, sysInfo.curId);
       m->count++;
+      m->contention++;
+
+      //Lend the owner our priority so less urgent threads cannot keep
+      //it from getting to the unlock
+      mutex_inherit(m->owner);
       yield();
    }
 
@@ -85,19 +180,32 @@ void mutex_lock(mutex_t *m) {
 void mutex_unlock(mutex_t *m) {
    cli();
    uint8_t oldId = sysInfo.curId;
-   regs_context_switch *intr;
+   int next = -1;
 
    //Only owner can unlock
    if (m->owner == sysInfo.curId) {
 
       //If someone is waiting for it set that person to be the owner
       if (m->count > 0) {
-         m->owner = mutex_dequeue(m);
-         sysInfo.threads[m->owner].state = THREAD_READY;
+         next = mutex_dequeue(m);
+         m->owner = next;
+         TRACE(TRACE_MUTEX_PASS, next);
          m->count--;
+
+         //The new owner inherits from whoever is still waiting
+         mutex_inherit(next);
+         thread_ready(next);
       }
       else
          m->owner = -1;   //Otherwise no owner
+
+      //Give back what was inherited through this mutex
+      mutex_inherit(oldId);
+
+      //Run the new owner right away if it is more urgent
+      if (next != -1 &&
+       sysInfo.threads[next].priority > sysInfo.threads[oldId].priority)
+         preempt();
    }
    sei();
 }
@@ -131,7 +239,7 @@ void sem_signal(semaphore_t *s) {
    if (s->value <= 0) {
       //Remove next thread in waitlist
       id = sem_dequeue(s);
-      sysInfo.threads[id].state = THREAD_READY;
+      thread_ready(id);
    }
    sei();
 }
@@ -147,17 +255,40 @@ void sem_signal_swap(semaphore_t *s) {
       intr = (regs_context_switch *)(sysInfo.threads[oldId].tp);
       sysInfo.threads[oldId].intr_pcl = intr->pcl;
       sysInfo.threads[oldId].intr_pch = intr->pch;
-      sysInfo.threads[oldId].state = THREAD_READY;
+      thread_ready(oldId);
 
       sysInfo.curId = sem_dequeue(s);
       sysInfo.threads[sysInfo.curId].state = THREAD_RUNNING;
       sysInfo.threads[sysInfo.curId].sched_count++;
+      thread_charge(oldId);
       context_switch(&sysInfo.threads[sysInfo.curId].tp,
        &sysInfo.threads[oldId].tp);
    }
    sei();
 }
 
+void event_init(event_t *e) {
+
+   e->waiter = -1;
+   e->set = 0;
+}
+
+//Block until the event is set, returns at once if it already was
+void event_wait(event_t *e) {
+   cli();
+
+   if (e->set)
+      e->set = 0;
+   else {
+      e->waiter = sysInfo.curId;
+      yield();
+   }
+
+   sei();
+}
+
+//Block the running thread until whatever it waits on readies it and switch
+//to the most urgent ready thread.  Interrupts must be disabled.
 void yield() {
    uint8_t oldId = sysInfo.curId;
    regs_context_switch *intr;
@@ -165,11 +296,12 @@ void yield() {
    intr = (regs_context_switch *)(sysInfo.threads[oldId].tp);
    sysInfo.threads[oldId].intr_pcl = intr->pcl;
    sysInfo.threads[oldId].intr_pch = intr->pch;
-   sysInfo.threads[oldId].state = THREAD_WAITING;
+   sysInfo.threads[oldId].state = THREAD_BLOCKED;
 
    sysInfo.curId = get_next_thread();
    sysInfo.threads[sysInfo.curId].state = THREAD_RUNNING;
    sysInfo.threads[sysInfo.curId].sched_count++;
+   thread_charge(oldId);
    context_switch(&sysInfo.threads[sysInfo.curId].tp,
     &sysInfo.threads[oldId].tp);
 }
@@ -3,12 +3,16 @@
 
 #include "os.h"
 
-volatile typedef struct {
+//The owner runs at the priority of the most urgent thread waiting for it,
+//passed on to the owner of any mutex the owner is waiting for in turn
+volatile typedef struct mutex {
    int owner;
    uint8_t list[MAX_THREADS];    //List of threads waiting
    uint8_t count;                //Number of threads waiting
    int front;                    //Head index of the waiting list
    int end;                      //End index of the waiting list
+   uint16_t contention;          //Number of locks that had to wait
+   volatile struct mutex *next;  //Next initialized mutex
 } mutex_t;
 
 volatile typedef struct {
@@ -18,6 +22,12 @@ volatile typedef struct {
    int end;                      //End index of the waiting list
 } semaphore_t;
 
+//Event with a single waiting thread that can be set from an interrupt
+volatile typedef struct {
+   int8_t waiter;                //Thread waiting, -1 if none
+   uint8_t set;                  //Set while nobody was waiting
+} event_t;
+
 //Synchronization functions
 void mutex_init(mutex_t *m);
 void mutex_lock(mutex_t *m);
@@ -26,6 +36,19 @@ void sem_init(semaphore_t *s, int8_t value);
 void sem_wait(semaphore_t *s);
 void sem_signal(semaphore_t *s);
 void sem_signal_swap(semaphore_t *s);
+void event_init(event_t *e);
+void event_wait(event_t *e);
 void yield();
 
+//Wake the waiting thread, for use in interrupt routines only.  Inline so
+//the routine calling it does not have to save every register.
+static inline void event_set_isr(event_t *e) {
+   if (e->waiter >= 0) {
+      thread_ready(e->waiter);
+      e->waiter = -1;
+   }
+   else
+      e->set = 1;
+}
+
 #endif
@@ -0,0 +1,67 @@
+#include "globals.h"
+#include "screen.h"
+#include "SdReader.h"
+#include "trace.h"
+
+#if TRACE_LEN
+trace_t traceBuf[TRACE_LEN];
+volatile uint8_t traceHead;
+volatile uint8_t traceOff;
+
+static void trace_send(const uint8_t *p, uint8_t count) {
+   screen_wait(count);
+   while (count--)
+      write_byte(*p++);
+}
+
+static void trace_head(uint8_t *head) {
+   memcpy(head, TRACE_MAGIC, 4);
+   head[4] = TRACE_LEN;
+   head[5] = CLOCK_PER_TICK;
+   head[6] = TICK_HZ & 0xFF;
+   head[7] = TICK_HZ >> 8;
+}
+
+//Write the ring out over serial, waiting for room rather than dropping
+//bytes.  Events are not recorded meanwhile so the dump is consistent,
+//recording starts again after it, also when an underrun stopped it.
+void trace_dump(void) {
+   uint8_t head[TRACE_HEAD_LEN], i;
+
+   traceOff = 1;
+
+   trace_head(head);
+   trace_send(head, TRACE_HEAD_LEN);
+
+   for (i = 0; i < TRACE_LEN; i++)
+      trace_send((uint8_t *)&traceBuf[(traceHead + i) & (TRACE_LEN - 1)],
+       sizeof(trace_t));
+
+   traceOff = 0;
+}
+
+//Write the ring to the card as a dump padded to TRACE_BLOCKS sectors,
+//in one multiple block write.  Call it with the card to itself, it holds
+//the card until the last block is programmed.  Recording starts again
+//after it as after trace_dump().
+uint8_t trace_save(uint32_t sector) {
+   uint8_t head[TRACE_HEAD_LEN], i, ok;
+
+   traceOff = 1;
+
+   trace_head(head);
+   ok = sdWriteStart(sector, TRACE_BLOCKS) &&
+    sdWriteNext(head, TRACE_HEAD_LEN);
+
+   for (i = 0; ok && i < TRACE_LEN; i++)
+      ok = sdWriteNext(
+       (uint8_t *)&traceBuf[(traceHead + i) & (TRACE_LEN - 1)],
+       sizeof(trace_t));
+
+   //Stop the write even after a failure, it leaves the card deselected
+   ok = sdWriteStop() && ok;
+
+   traceOff = 0;
+   return ok;
+}
+#endif
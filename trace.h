@@ -0,0 +1,104 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <avr/io.h>
+
+//In-RAM trace of scheduler and I/O events.
+//
+//The ring keeps the last TRACE_LEN events, a power of two, build with
+//TRACE_LEN=0 to leave tracing out.  The 't' key dumps it over serial and
+//host/tracedump.c turns the dump into a timeline.  An event is 4 bytes:
+//type, argument and a timestamp with the low byte of the tick count in
+//the high byte and the tick timer count in the low byte, so it wraps
+//every 256 ticks.  Slots never written have type 0.
+//
+//Recording stops at the first underrun so the ring keeps what led up
+//to it, the dump starts recording again.  The player also keeps the
+//traces of the first underruns on the card, in TRACE_LOG_PATH, a file
+//made on the host that trace_save() overwrites in place.
+#ifndef TRACE_LEN
+#define TRACE_LEN 16
+#endif
+
+//Event types, with what the argument holds
+#define TRACE_SWITCH 1        //Context switch, new thread << 4 | old thread
+#define TRACE_MUTEX_WAIT 2    //Mutex held, owner << 4 | waiting thread
+#define TRACE_MUTEX_PASS 3    //Unlock handed the mutex over, new owner
+#define TRACE_SD_CMD 4        //SD command sent, command index
+#define TRACE_SD_R1 5         //SD command answered, R1 status
+#define TRACE_SD_DATA 6       //SD data token received, the token
+#define TRACE_UNDERRUN 7      //Sample interrupt ran dry
+#define TRACE_LOW 8           //Sample interrupt asked for more audio
+#define TRACE_FULL 9          //Reader filled the buffer, ticks it took
+
+//A dump is TRACE_MAGIC, TRACE_LEN, CLOCK_PER_TICK and TICK_HZ as 2 bytes
+//little endian, then the events oldest first
+#define TRACE_MAGIC "TRC1"
+#define TRACE_HEAD_LEN 8
+
+//Log file and the sectors a dump takes in it
+#define TRACE_LOG_PATH ".trace"
+#define TRACE_BLOCKS ((TRACE_HEAD_LEN + TRACE_LEN * 4 + 511) / 512)
+
+typedef struct {
+   uint8_t type;
+   uint8_t arg;
+   uint16_t time;    //Little endian
+} trace_t;
+
+#ifdef SD_EMULATOR
+//Host builds have no clock to stamp events with
+#define TRACE(type, arg)
+#elif TRACE_LEN
+#include <avr/interrupt.h>
+#include "os.h"
+
+typedef char traceLenCheck[TRACE_LEN <= 128 &&
+ !(TRACE_LEN & (TRACE_LEN - 1)) ? 1 : -1];
+
+extern trace_t traceBuf[TRACE_LEN];
+extern volatile uint8_t traceHead;  //Slot the next event goes to
+extern volatile uint8_t traceOff;   //Set after an underrun and while dumping
+
+void trace_dump(void);
+uint8_t trace_save(uint32_t sector);
+
+//An underrun stopped recording and the ring was not dumped since
+static inline uint8_t trace_frozen(void) {
+   return traceOff;
+}
+
+//Record an event, from threads or interrupt routines
+static inline void trace(uint8_t type, uint8_t arg) {
+   uint8_t sreg = SREG, count, ticks, i;
+
+   cli();
+   if (!traceOff) {
+      count = TCNT0;
+      ticks = sysInfo.numIntr;
+
+      //The count already restarted for a tick not yet counted
+      if ((TIFR0 & _BV(OCF0A)) && count < CLOCK_PER_TICK / 2)
+         ticks++;
+
+      i = traceHead;
+      traceBuf[i].type = type;
+      traceBuf[i].arg = arg;
+      traceBuf[i].time = (uint16_t)ticks << 8 | count;
+      traceHead = (i + 1) & (TRACE_LEN - 1);
+
+      if (type == TRACE_UNDERRUN)
+         traceOff = 1;
+   }
+   SREG = sreg;
+}
+
+#define TRACE(type, arg) trace(type, arg)
+#else
+#define TRACE(type, arg)
+#define trace_dump()
+#define trace_save(sector) 0
+#define trace_frozen() 0
+#endif
+
+#endif
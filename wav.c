@@ -0,0 +1,124 @@
+#include "wav.h"
+#include "ext2.h"
+#include "globals.h"
+
+//Sample rates accepted.  Timer 1 could run as slow as F_CPU / 65536,
+//about 245 Hz, but a header claiming less than 4 kHz is more likely
+//corrupt than real audio, and above 32 kHz the sample interrupt would
+//leave the reader too little of the CPU.
+#define MIN_RATE 4000
+#define MAX_RATE 32000
+
+//Play the whole file as 8 bit mono samples at the default rate
+static void rawFormat(struct wav_format *format) {
+
+   format->sampleRate = SAMPLE_RATE;
+   format->byteRate = SAMPLE_RATE;
+   format->channels = 1;
+   format->bits = 8;
+   format->frameSize = 1;
+}
+
+static uint8_t validFormat(struct wav_fmt *fmt) {
+
+   return fmt->audioFormat == WAV_PCM &&
+    (fmt->channels == 1 || fmt->channels == 2) &&
+    (fmt->bitsPerSample == 8 || fmt->bitsPerSample == 16) &&
+    fmt->sampleRate >= MIN_RATE && fmt->sampleRate <= MAX_RATE &&
+    fmt->blockAlign == fmt->channels * fmt->bitsPerSample / 8 &&
+    fmt->byteRate == fmt->sampleRate * fmt->blockAlign;
+}
+
+/*
+ * Open a track and find its audio data.
+ *
+ * The RIFF chunks are walked until the "data" chunk, the file position is
+ * set to its start and playback loops over it.  Files that are not a PCM
+ * wave file this player can output are played whole as raw 8 bit mono
+ * samples at SAMPLE_RATE, and 0 is returned.
+ */
+uint8_t wavOpen(uint8_t ndx, struct wav_format *format) {
+   struct riff_chunk chunk;
+   struct wav_fmt fmt;
+   uint32_t offset = 12, size, wave;
+   uint8_t haveFmt = 0;
+
+   getFile(ndx);
+   rawFormat(format);
+
+   size = getCurrentSize();
+   if (size < offset)
+      return 0;
+
+   getBlockData(0, &chunk, sizeof(chunk));
+   getBlockData(8, &wave, sizeof(wave));
+   if (chunk.id != WAV_RIFF || wave != WAV_WAVE)
+      return 0;
+
+   while (offset + sizeof(chunk) <= size) {
+      getBlockData(offset, &chunk, sizeof(chunk));
+      offset += sizeof(chunk);
+
+      if (chunk.id == WAV_FMT && chunk.size >= sizeof(fmt)) {
+         getBlockData(offset, &fmt, sizeof(fmt));
+         if (!validFormat(&fmt))
+            return 0;
+         haveFmt = 1;
+      }
+      else if (chunk.id == WAV_DATA && haveFmt) {
+         if (chunk.size > size - offset)
+            chunk.size = size - offset;
+
+         //Whole frames only
+         chunk.size -= chunk.size % fmt.blockAlign;
+         if (!chunk.size)
+            return 0;
+
+         format->sampleRate = fmt.sampleRate;
+         format->byteRate = fmt.byteRate;
+         format->channels = fmt.channels;
+         format->bits = fmt.bitsPerSample;
+         format->frameSize = fmt.blockAlign;
+
+         setFileData(offset, chunk.size);
+         return 1;
+      }
+
+      //A corrupt size would wrap the offset and walk the file forever
+      if (chunk.size > size - offset)
+         return 0;
+
+      offset += chunk.size + (chunk.size & 1);
+   }
+
+   return 0;
+}
+
+/*
+ * Convert frames in place to the 8 bit unsigned mono samples the PWM
+ * output plays, returns the number of samples.
+ */
+uint8_t wavConvert(uint8_t *buffer, uint8_t count, struct wav_format *format) {
+   uint8_t *src = buffer;
+   uint8_t i, n = count / format->frameSize;
+   int16_t left, right;
+
+   for (i = 0; i < n; i++) {
+      //16 bit samples are signed, keep the high byte
+      if (format->bits == 16) {
+         left = (int8_t)src[1];
+         right = (int8_t)src[format->frameSize - 1];
+      } else {
+         left = src[0] - 128;
+         right = src[format->frameSize - 1] - 128;
+      }
+      src += format->frameSize;
+
+      if (format->channels == 2)
+         left = (left + right) >> 1;
+
+      buffer[i] = left + 128;
+   }
+
+   return n;
+}
@@ -0,0 +1,44 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <inttypes.h>
+
+//RIFF chunk ids, as read from the file in little endian
+#define WAV_RIFF 0x46464952   //"RIFF"
+#define WAV_WAVE 0x45564157   //"WAVE"
+#define WAV_FMT  0x20746D66   //"fmt "
+#define WAV_DATA 0x61746164   //"data"
+
+//Audio format of uncompressed PCM data
+#define WAV_PCM 1
+
+//Header of every RIFF chunk
+struct riff_chunk {
+   uint32_t id;               //Chunk id
+   uint32_t size;             //Size of the chunk data, padded to even
+};
+
+//Data of the "fmt " chunk
+struct wav_fmt {
+   uint16_t audioFormat;      //WAV_PCM
+   uint16_t channels;         //1 mono, 2 stereo
+   uint32_t sampleRate;       //Frames per second
+   uint32_t byteRate;         //Bytes per second
+   uint16_t blockAlign;       //Bytes per frame
+   uint16_t bitsPerSample;    //8 or 16
+};
+
+//Format of the open track
+struct wav_format {
+   uint16_t sampleRate;       //Frames per second
+   uint32_t byteRate;         //Bytes of file data per second
+   uint8_t channels;          //1 or 2
+   uint8_t bits;              //8 or 16
+   uint8_t frameSize;         //Bytes per frame
+};
+
+uint8_t wavOpen(uint8_t ndx, struct wav_format *format);
+
+uint8_t wavConvert(uint8_t *buffer, uint8_t count, struct wav_format *format);
+
+#endif